@@ -0,0 +1,59 @@
+#include <benchmark/benchmark.h>
+
+#include <memory_resource>
+#include <string>
+
+#include "compiler.h"
+#include "heap.h"
+#include "scanner.h"
+
+// Nested functions close to the limit of 256 locals, with the innermost one
+// reading variables of every enclosing function many times.
+static std::string generate_nested_functions(int depth, int locals) noexcept {
+  std::string source;
+  for (int level = 0; level < depth; ++level) {
+    source += "fun f" + std::to_string(level) + "() {\n";
+    for (int i = 0; i < locals; ++i) {
+      source += "var v" + std::to_string(level) + "_" + std::to_string(i) +
+                " = " + std::to_string(i) + ";\n";
+    }
+  }
+  source += "var sum = 0;\n";
+  for (int repeat = 0; repeat < 10; ++repeat) {
+    for (int level = 0; level < depth - 1; ++level) {
+      for (int i = 0; i < locals; i += locals / 40) {
+        source += "sum = sum + v" + std::to_string(level) + "_" +
+                  std::to_string(i) + ";\n";
+      }
+    }
+  }
+  for (int level = 0; level < depth; ++level) {
+    source += "}\n";
+  }
+  return source;
+}
+
+static void compile_nested_functions(benchmark::State& state) {
+  const auto source = generate_nested_functions(6, 250);
+  lox::Scanner scanner{source};
+  const auto tokens = scanner.scan();
+  while (state.KeepRunning()) {
+    lox::Heap heap;
+    lox::Compiler compiler{heap};
+    benchmark::DoNotOptimize(compiler.compile(tokens));
+  }
+}
+BENCHMARK(compile_nested_functions);
+
+// Scans and compiles a script the way VM::interpret does.
+static void scan_and_compile(benchmark::State& state) {
+  const auto source = generate_nested_functions(4, 100);
+  while (state.KeepRunning()) {
+    lox::Heap heap;
+    lox::Compiler compiler{heap};
+    std::pmr::monotonic_buffer_resource token_arena;
+    lox::Scanner scanner{source};
+    benchmark::DoNotOptimize(compiler.compile(scanner.scan(&token_arena)));
+  }
+}
+BENCHMARK(scan_and_compile);
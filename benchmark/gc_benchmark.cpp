@@ -0,0 +1,158 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "gc.h"
+#include "hash_table.h"
+#include "heap.h"
+#include "object.h"
+#include "stack.h"
+#include "value.h"
+
+namespace {
+
+struct Call_frame {
+  lox::Closure* closure;
+};
+using Call_frame_stack = lox::Stack<Call_frame, 1>;
+using Value_stack = lox::Stack<lox::Value, 1>;
+
+struct No_compiler {
+  template <typename Visitor>
+  void for_each_func(Visitor&&) noexcept {}
+};
+
+constexpr int fanout = 4;
+
+// A tree of functions, each holding its children and a string as constants.
+lox::Function* make_tree(lox::Heap& heap, int depth, int& count) {
+  const auto func = heap.make_object<lox::Function>();
+  func->get_chunk().add_constant(heap.make_string(std::to_string(count++)));
+  if (depth > 0) {
+    for (int i = 0; i < fanout; ++i) {
+      func->get_chunk().add_constant(make_tree(heap, depth - 1, count));
+    }
+  }
+  return func;
+}
+
+}  // namespace
+
+// Collects a heap where every object is live, so that the time goes to marking
+// the graph; the sweep does not depend on the number of marker threads.
+static void collect_large_graph(benchmark::State& state) {
+  lox::Heap heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  No_compiler compiler;
+  lox::Gc_options options;
+  options.marker_threads = static_cast<size_t>(state.range(0));
+  lox::GC<lox::Heap, lox::Hash_table, Value_stack, Call_frame_stack,
+          No_compiler>
+      gc{heap, globals, stack, call_frames, compiler, options};
+
+  int count = 0;
+  stack.push(make_tree(heap, 9, count));
+  gc.collect_garbage();
+  while (state.KeepRunning()) {
+    gc.collect_garbage();
+  }
+  state.SetItemsProcessed(state.iterations() * count * 2);
+}
+BENCHMARK(collect_large_graph)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Collects an old generation where one string in sixteen survives, with and
+// without compaction, and reports the pages left in use.
+static void collect_fragmented_heap(benchmark::State& state) {
+  constexpr int count = 64 * 1024;
+  constexpr int kept_every = 16;
+  size_t pages = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    lox::Heap heap;
+    lox::Hash_table globals;
+    Value_stack stack;
+    Call_frame_stack call_frames;
+    No_compiler compiler;
+    lox::Gc_options options;
+    options.compact = state.range(0) != 0;
+    lox::GC<lox::Heap, lox::Hash_table, Value_stack, Call_frame_stack,
+            No_compiler>
+        gc{heap, globals, stack, call_frames, compiler, options};
+    const auto kept = heap.make_object<lox::Function>();
+    const auto all = heap.make_object<lox::Function>();
+    stack.push(kept);
+    stack.push(all);
+    for (int i = 0; i < count; ++i) {
+      const auto string = heap.make_string(std::to_string(i));
+      all->get_chunk().add_constant(string);
+      if (i % kept_every == 0) {
+        kept->get_chunk().add_constant(string);
+      }
+    }
+    gc.collect_garbage();
+    stack.pop();
+    state.ResumeTiming();
+
+    gc.collect_garbage();
+    pages = heap.get_allocator().page_count();
+  }
+  state.counters["pages"] = static_cast<double>(pages);
+}
+BENCHMARK(collect_fragmented_heap)->Arg(0)->Arg(1)->Unit(
+    benchmark::kMillisecond);
+
+// Interns a burst of strings that die, then keeps interning unique strings
+// that live for one collection each, the way a long-running script churns
+// through them. The intern table should end up as small and as quick to probe
+// after many rounds as after a few.
+static void churn_interned_strings(benchmark::State& state) {
+  constexpr int burst = 64 * 1024;
+  constexpr int per_round = 4096;
+  const auto rounds = static_cast<int>(state.range(0));
+  lox::Heap heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  No_compiler compiler;
+  lox::Gc_options options;
+  lox::GC<lox::Heap, lox::Hash_table, Value_stack, Call_frame_stack,
+          No_compiler>
+      gc{heap, globals, stack, call_frames, compiler, options};
+
+  int next = 0;
+  const auto keep_strings = [&](int count) {
+    const auto func = heap.make_object<lox::Function>();
+    for (int i = 0; i < count; ++i) {
+      func->get_chunk().add_constant(heap.make_string(std::to_string(next++)));
+    }
+    if (!stack.empty()) {
+      stack.pop();
+    }
+    stack.push(func);
+    gc.collect_garbage();
+  };
+  for (auto _ : state) {
+    keep_strings(burst);
+    for (int round = 0; round < rounds; ++round) {
+      keep_strings(per_round);
+    }
+  }
+  const auto& interned = heap.get_interned_strings();
+  state.counters["interned"] = static_cast<double>(interned.size());
+  state.counters["capacity"] = static_cast<double>(interned.get_capacity());
+  const auto probes = interned.probe_lengths();
+  state.counters["probe_mean"] = probes.mean;
+  state.counters["probe_max"] = static_cast<double>(probes.max);
+}
+BENCHMARK(churn_interned_strings)
+    ->Arg(16)
+    ->Arg(256)
+    ->Unit(benchmark::kMillisecond);
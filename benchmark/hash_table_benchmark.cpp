@@ -1,27 +1,221 @@
 #include <benchmark/benchmark.h>
 
-#include <memory>
+#include <cstdint>
+#include <string>
+#include <vector>
 
+#include "hash.h"
 #include "hash_table.h"
+#include "heap.h"
 #include "object.h"
 
-static void hash_table(benchmark::State& state) {
-  while (state.KeepRunning()) {
+namespace {
+
+// The keys of all table benchmarks, made as they are first needed in a heap
+// that is never collected, so that later runs at a size do not pay for them.
+// Each string comes with a copy of its text, for lookups by text.
+struct Key_pool {
+  lox::Heap heap;
+  std::vector<lox::String*> strings;
+  std::vector<std::string> texts;
+
+  const std::vector<lox::String*>& get(size_t count) {
+    while (strings.size() < count) {
+      texts.push_back("key " + std::to_string(strings.size()));
+      strings.push_back(heap.make_string(texts.back()));
+    }
+    return strings;
+  }
+};
+
+Key_pool& key_pool() {
+  static Key_pool pool;
+  return pool;
+}
+
+void fill(lox::Hash_table& table, const std::vector<lox::String*>& keys,
+          size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    table.insert(keys[i], lox::Value{static_cast<double>(i)});
+  }
+}
+
+void report(benchmark::State& state, const lox::Hash_table& table) {
+  table.get_stats().for_each([&](const char* name, auto value) {
+    state.counters[name] = static_cast<double>(value);
+  });
+}
+
+void table_sizes(benchmark::internal::Benchmark* benchmark) {
+  benchmark->RangeMultiplier(8)->Range(8, 1 << 22);
+}
+
+}  // namespace
+
+// Builds a table from empty, through every growth on the way to its size.
+static void hash_table_insert(benchmark::State& state) {
+  const auto count = static_cast<size_t>(state.range(0));
+  const auto& keys = key_pool().get(count);
+  for (auto _ : state) {
     lox::Hash_table table;
-    std::vector<std::unique_ptr<lox::String>> strings;
-    for (auto i = 0; i < 100; ++i) {
-      strings.emplace_back(
-          std::make_unique<lox::String>("test string " + std::to_string(i)));
+    fill(table, keys, count);
+    benchmark::DoNotOptimize(table.size());
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  lox::Hash_table table;
+  fill(table, keys, count);
+  report(state, table);
+}
+BENCHMARK(hash_table_insert)->Apply(table_sizes);
+
+// Looks up every key of the table.
+static void hash_table_get(benchmark::State& state) {
+  const auto count = static_cast<size_t>(state.range(0));
+  const auto& keys = key_pool().get(count);
+  lox::Hash_table table;
+  fill(table, keys, count);
+  for (auto _ : state) {
+    double sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+      sum += table.get_if(keys[i])->as_double();
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  report(state, table);
+}
+BENCHMARK(hash_table_get)->Apply(table_sizes);
+
+// Looks up as many keys that are not in the table, the way a global is looked
+// up in a scope before it is defined.
+static void hash_table_miss(benchmark::State& state) {
+  const auto count = static_cast<size_t>(state.range(0));
+  const auto& keys = key_pool().get(2 * count);
+  lox::Hash_table table;
+  fill(table, keys, count);
+  for (auto _ : state) {
+    for (size_t i = count; i < 2 * count; ++i) {
+      benchmark::DoNotOptimize(table.get_if(keys[i]));
     }
-    for (std::size_t i = 0; i < strings.size(); ++i) {
-      table.insert(strings[i].get(), lox::Value{static_cast<double>(i)});
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  report(state, table);
+}
+BENCHMARK(hash_table_miss)->Apply(table_sizes);
+
+// Erases the oldest key and inserts a new one, over and over, so that the
+// table keeps its size while deleted slots come and go.
+static void hash_table_churn(benchmark::State& state) {
+  const auto count = static_cast<size_t>(state.range(0));
+  const auto& keys = key_pool().get(2 * count);
+  lox::Hash_table table;
+  fill(table, keys, count);
+  size_t oldest = 0;
+  for (auto _ : state) {
+    for (size_t i = 0; i < count; ++i) {
+      table.erase(keys[oldest]);
+      table.insert(keys[(oldest + count) % (2 * count)], lox::Value{});
+      oldest = (oldest + 1) % (2 * count);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  report(state, table);
+}
+BENCHMARK(hash_table_churn)->Apply(table_sizes);
+
+// Finds every key by its text, as interning a string that already exists
+// does; the hashes are computed beforehand.
+static void hash_table_find_string(benchmark::State& state) {
+  const auto count = static_cast<size_t>(state.range(0));
+  auto& pool = key_pool();
+  const auto& keys = pool.get(count);
+  lox::Hash_table table;
+  fill(table, keys, count);
+  for (auto _ : state) {
+    for (size_t i = 0; i < count; ++i) {
+      benchmark::DoNotOptimize(
+          table.find_string(pool.texts[i], keys[i]->get_hash()));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  report(state, table);
+}
+BENCHMARK(hash_table_find_string)->Apply(table_sizes);
+
+namespace {
+
+enum Key_set { identifiers, numbers, sentences };
+
+// Keys like those a script interns: short identifiers sharing prefixes, the
+// texts of numbers and longer concatenated strings.
+std::vector<std::string> make_keys(int key_set) {
+  constexpr int count = 4096;
+  std::vector<std::string> keys;
+  for (int i = 0; i < count; ++i) {
+    switch (key_set) {
+      case identifiers:
+        keys.push_back("var_" + std::to_string(i));
+        break;
+      case numbers:
+        keys.push_back(std::to_string(i * 0.25));
+        break;
+      default:
+        keys.push_back("the quick brown fox number " + std::to_string(i) +
+                       " jumps over the lazy dog and keeps on running");
+        break;
     }
-    double result = 0;
-    for (std::size_t i = 0; i < strings.size(); ++i) {
-      if (auto value = table.get_if(strings[i].get()); value != nullptr) {
-        benchmark::DoNotOptimize(result += value->as_double());
-      }
+  }
+  return keys;
+}
+
+}  // namespace
+
+// Hashes every key, and reports how often linear probing in a table of a
+// Hash_table's maximum load finds the home slot taken and how many slots a
+// lookup visits on average.
+template <typename Hash>
+static void hash_keys(benchmark::State& state) {
+  const auto keys = make_keys(static_cast<int>(state.range(0)));
+  const Hash hash;
+  size_t bytes = 0;
+  for (const auto& key : keys) {
+    bytes += key.size();
+  }
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      benchmark::DoNotOptimize(hash(key));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+  state.SetBytesProcessed(state.iterations() * bytes);
+
+  size_t capacity = 8;
+  while (keys.size() > capacity * 3 / 4) {
+    capacity *= 2;
+  }
+  std::vector<bool> taken(capacity);
+  size_t collisions = 0;
+  size_t probes = 0;
+  for (const auto& key : keys) {
+    auto index = hash(key) & (capacity - 1);
+    collisions += taken[index];
+    while (taken[index]) {
+      index = (index + 1) & (capacity - 1);
+      ++probes;
     }
+    taken[index] = true;
+    ++probes;
   }
+  state.counters["collisions"] =
+      static_cast<double>(collisions) / static_cast<double>(keys.size());
+  state.counters["probes"] =
+      static_cast<double>(probes) / static_cast<double>(keys.size());
 }
-BENCHMARK(hash_table);
+BENCHMARK_TEMPLATE(hash_keys, lox::hash::Fnv1a)
+    ->Arg(identifiers)
+    ->Arg(numbers)
+    ->Arg(sentences);
+BENCHMARK_TEMPLATE(hash_keys, lox::hash::Wyhash)
+    ->Arg(identifiers)
+    ->Arg(numbers)
+    ->Arg(sentences);
@@ -0,0 +1,103 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+#include "heap.h"
+#include "object.h"
+#include "vm.h"
+
+constexpr int objects_per_round = 1000;
+
+template <typename Make>
+static void allocate_and_sweep(benchmark::State& state, Make make) noexcept {
+  lox::Heap heap;
+  while (state.KeepRunning()) {
+    for (int i = 0; i < objects_per_round; ++i) {
+      benchmark::DoNotOptimize(make(heap));
+    }
+    heap.sweep_young();
+  }
+  state.SetItemsProcessed(state.iterations() * objects_per_round);
+}
+
+static void allocate_upvalues(benchmark::State& state) {
+  allocate_and_sweep(state, [](lox::Heap& heap) {
+    return heap.make_object<lox::Upvalue>(nullptr);
+  });
+}
+BENCHMARK(allocate_upvalues);
+
+static void allocate_closures(benchmark::State& state) {
+  lox::Function func;
+  func.captures.resize(2);
+  allocate_and_sweep(state, [&](lox::Heap& heap) {
+    return heap.make_closure(&func);
+  });
+}
+BENCHMARK(allocate_closures);
+
+static void allocate_strings(benchmark::State& state) {
+  // Distinct texts, so that interning does not return an existing string.
+  allocate_and_sweep(state, [i = 0](lox::Heap& heap) mutable {
+    return heap.make_string(std::to_string(i++ % objects_per_round));
+  });
+}
+BENCHMARK(allocate_strings);
+
+// Builds trees of closures, each node capturing its two children, so nearly
+// all of the run time goes to allocating and collecting closures and upvalues.
+static void closure_trees(benchmark::State& state) {
+  const std::string source{R"(
+fun make_tree(depth) {
+  if (depth == 0) {
+    fun leaf() { return 1; }
+    return leaf;
+  }
+  var left = make_tree(depth - 1);
+  var right = make_tree(depth - 1);
+  fun node() { return left() + right() + 1; }
+  return node;
+}
+var total = 0;
+for (var i = 0; i < 10; i = i + 1) {
+  total = total + make_tree(6)();
+}
+print total;
+)"};
+  while (state.KeepRunning()) {
+    std::ostringstream out;
+    lox::VM vm{out};
+    vm.interpret(source);
+  }
+}
+BENCHMARK(closure_trees);
+
+// Allocates a closure on every iteration, so the collector keeps running;
+// reports the longest and the p99 pause as counters.
+static void closure_churn(benchmark::State& state) {
+  const std::string source{R"(
+var count = 0;
+for (var i = 0; i < 200000; i = i + 1) {
+  fun f() { return 1; }
+  count = count + f();
+}
+print count;
+)"};
+  lox::Pause_recorder::Duration p99{};
+  lox::Pause_recorder::Duration max{};
+  while (state.KeepRunning()) {
+    std::ostringstream out;
+    lox::VM vm{out};
+    vm.interpret(source);
+    const auto& pauses = vm.get_gc_stats().pauses;
+    p99 = std::max(p99, pauses.percentile(0.99));
+    max = std::max(max, pauses.max());
+  }
+  using Microseconds = std::chrono::duration<double, std::micro>;
+  state.counters["p99_pause_us"] = Microseconds{p99}.count();
+  state.counters["max_pause_us"] = Microseconds{max}.count();
+}
+BENCHMARK(closure_churn);
@@ -0,0 +1,41 @@
+#include <benchmark/benchmark.h>
+
+#include <fstream>
+#include <string>
+
+#include "compiler.h"
+#include "config.h"
+#include "heap.h"
+#include "image.h"
+#include "scanner.h"
+
+static std::string load_example(const std::string& name) noexcept {
+  std::ifstream ifs(EXAMPLES_DIR "/benchmark/" + name + ".lox");
+  return std::string{std::istreambuf_iterator<char>{ifs},
+                     std::istreambuf_iterator<char>{}};
+}
+
+static void compile_from_source(benchmark::State& state) {
+  const auto source = load_example("fib") + load_example("equality");
+  while (state.KeepRunning()) {
+    lox::Heap heap;
+    lox::Compiler compiler{heap};
+    lox::Scanner scanner{source};
+    benchmark::DoNotOptimize(compiler.compile(scanner.scan()));
+  }
+}
+BENCHMARK(compile_from_source);
+
+static void load_from_image(benchmark::State& state) {
+  const auto source = load_example("fib") + load_example("equality");
+  lox::Heap heap;
+  lox::Compiler compiler{heap};
+  lox::Scanner scanner{source};
+  const auto bytes = lox::image::save(*compiler.compile(scanner.scan()));
+  while (state.KeepRunning()) {
+    lox::Heap image_heap;
+    benchmark::DoNotOptimize(
+        lox::image::load(bytes.data(), bytes.size(), image_heap));
+  }
+}
+BENCHMARK(load_from_image);
@@ -29,6 +29,10 @@ static void run(std::string source) noexcept {
   }                                                                     \
   BENCHMARK(name);
 
+LOX_BENCHMARK(adders)
+LOX_BENCHMARK(closures)
 LOX_BENCHMARK(equality)
 LOX_BENCHMARK(fib)
+LOX_BENCHMARK(helpers)
+LOX_BENCHMARK(string_append)
 LOX_BENCHMARK(sum)
@@ -0,0 +1,483 @@
+#ifndef LOX_ALLOCATOR_H
+#define LOX_ALLOCATOR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "contract.h"
+
+namespace lox {
+
+// Hands out storage for heap objects from aligned pages that each serve a
+// single size class. A class first takes cells from its free list, then bumps
+// through its current page, and only then asks for a fresh page. Requests
+// larger than max_small_size get a page run of their own.
+//
+// Every page keeps side bitmaps of its allocated and marked cells, so marking
+// never writes into the objects and sweeping scans pages linearly. Sweeping is
+// lazy: begin_sweep only forgets the free lists, and each size class sweeps
+// its pages one at a time when it runs out of free cells.
+//
+// Young objects are bumped through the nursery, a run of pages that grows as
+// needed. In a nursery page the mark bit of an object means that it has moved
+// and that its first word holds the new address. The same holds for sparse old
+// pages while they are being evacuated.
+class Allocator {
+ public:
+  using Finalizer = void (*)(void* cell) noexcept;
+
+  static constexpr size_t page_size = 32 * 1024;
+  static constexpr size_t granularity = 16;
+  static constexpr size_t max_small_size = 512;
+
+  explicit Allocator(Finalizer finalizer = nullptr) noexcept
+      : finalizer{finalizer} {}
+
+  ~Allocator() noexcept {
+    release_evacuated();
+    for (auto page : nursery) {
+      finalize_young(page);
+      std::free(page);
+    }
+    for (auto& size_class : size_classes) {
+      release_pages(size_class.pages);
+    }
+    while (large_pages) {
+      const auto next = large_pages->next;
+      finalize(large_pages->begin());
+      std::free(large_pages);
+      large_pages = next;
+    }
+  }
+
+  Allocator(const Allocator&) noexcept = delete;
+  Allocator(Allocator&&) noexcept = delete;
+  Allocator& operator=(const Allocator&) noexcept = delete;
+  Allocator& operator=(Allocator&&) noexcept = delete;
+
+  void* allocate(size_t size) noexcept {
+    if (size > max_small_size) {
+      return allocate_large(size);
+    }
+    auto& size_class = size_classes[class_of(size)];
+    while (!size_class.free_cells && size_class.unswept) {
+      sweep_page(size_class);
+    }
+    std::byte* cell;
+    if (const auto free_cell = size_class.free_cells; free_cell) {
+      size_class.free_cells = free_cell->next;
+      cell = reinterpret_cast<std::byte*>(free_cell);
+    } else {
+      const auto cell_size = cell_size_of(size);
+      if (static_cast<size_t>(size_class.limit - size_class.bump) <
+          cell_size) {
+        const auto page = new_page(size_class.pages, cell_size, page_size);
+        size_class.pages = page;
+        ++count;
+        size_class.bump = page->begin();
+        size_class.limit = page->end();
+      }
+      cell = size_class.bump;
+      size_class.bump += cell_size;
+    }
+    page_of(cell)->set(&Page::allocated, cell);
+    return cell;
+  }
+
+  void* allocate_young(size_t size) noexcept {
+    ENSURES(size <= max_small_size);
+    const auto cell_size = cell_size_of(size);
+    if (static_cast<size_t>(nursery_limit - nursery_bump) < cell_size) {
+      next_nursery_page();
+    }
+    const auto cell = nursery_bump;
+    nursery_bump += cell_size;
+    page_of(cell)->set(&Page::allocated, cell);
+    return cell;
+  }
+
+  static bool is_young(const void* cell) noexcept {
+    return page_of(cell)->young;
+  }
+
+  static void forward(void* from, void* to) noexcept {
+    ENSURES(is_young(from) || page_of(from)->evacuating);
+    page_of(from)->set(&Page::marks, from);
+    *static_cast<void**>(from) = to;
+  }
+
+  static void* forwarded(const void* from) noexcept {
+    return page_of(from)->test(&Page::marks, from)
+               ? *static_cast<void* const*>(from)
+               : nullptr;
+  }
+
+  // Finalizes the young objects that did not move and empties the nursery,
+  // keeping at most max_pages of its pages for reuse.
+  void reset_nursery(size_t max_pages) noexcept {
+    for (size_t i = 0; i < nursery.size() && i <= nursery_current; ++i) {
+      finalize_young(nursery[i]);
+      nursery[i]->allocated = Bitmap{};
+      nursery[i]->marks = Bitmap{};
+    }
+    while (nursery.size() > max_pages && !nursery.empty()) {
+      std::free(nursery.back());
+      nursery.pop_back();
+    }
+    nursery_current = 0;
+    nursery_bump = nursery.empty() ? nullptr : nursery.front()->begin();
+    nursery_limit = nursery.empty() ? nullptr : nursery.front()->end();
+  }
+
+  size_t nursery_page_count() const noexcept { return nursery.size(); }
+
+  // Returns true if the cell was not remembered before.
+  static bool remember(const void* cell) noexcept {
+    const auto page = page_of(cell);
+    if (page->test(&Page::remembered, cell)) {
+      return false;
+    }
+    page->set(&Page::remembered, cell);
+    return true;
+  }
+
+  static void forget(const void* cell) noexcept {
+    page_of(cell)->reset(&Page::remembered, cell);
+  }
+
+  // Frees a cell without running the finalizer. While a sweep is pending, the
+  // cell is left for the sweep to collect.
+  void deallocate(void* pointer, size_t size) noexcept {
+    ENSURES(pointer);
+    const auto page = page_of(pointer);
+    ENSURES(page->test(&Page::allocated, pointer));
+    if (size > max_small_size) {
+      unlink_page(large_pages, page);
+      std::free(page);
+      return;
+    }
+    page->reset(&Page::allocated, pointer);
+    page->reset(&Page::marks, pointer);
+    if (auto& size_class = size_classes[class_of(size)]; !size_class.unswept) {
+      size_class.free_cells = new (pointer) Free_cell{size_class.free_cells};
+    }
+  }
+
+  // Returns true if the cell was not marked before.
+  static bool mark(const void* cell) noexcept {
+    const auto page = page_of(cell);
+    if (page->test(&Page::marks, cell)) {
+      return false;
+    }
+    page->set(&Page::marks, cell);
+    return true;
+  }
+
+  // Like mark, but safe to call for the same page from several threads.
+  static bool mark_atomic(const void* cell) noexcept {
+    return !page_of(cell)->test_and_set_atomic(&Page::marks, cell);
+  }
+
+  static bool is_marked(const void* cell) noexcept {
+    return page_of(cell)->test(&Page::marks, cell);
+  }
+
+  // Starts sweeping the cells left unmarked by the last marking. Large objects
+  // are swept right away; small ones as their size classes need free cells.
+  void begin_sweep() noexcept {
+    for (auto& size_class : size_classes) {
+      size_class.free_cells = nullptr;
+      size_class.bump = nullptr;
+      size_class.limit = nullptr;
+      size_class.unswept = size_class.pages;
+    }
+    for (auto page = large_pages; page;) {
+      const auto next = page->next;
+      if (page->test(&Page::marks, page->begin())) {
+        page->reset(&Page::marks, page->begin());
+      } else {
+        finalize(page->begin());
+        unlink_page(large_pages, page);
+        std::free(page);
+      }
+      page = next;
+    }
+  }
+
+  // Sweeps the pages not swept yet, which must happen before marking again.
+  void finish_sweep() noexcept {
+    for (auto& size_class : size_classes) {
+      while (size_class.unswept) {
+        sweep_page(size_class);
+      }
+    }
+  }
+
+  size_t page_count() const noexcept { return count; }
+
+  // Takes the pages where fewer than one cell in evacuation_ratio is marked
+  // out of their size classes, unless a page is the only one of its class, and
+  // finalizes their dead cells. Must come between begin_sweep and the next
+  // allocation. The live cells are then moved with for_each_evacuee and the
+  // pages freed with release_evacuated.
+  void begin_evacuation() noexcept {
+    for (auto& size_class : size_classes) {
+      ENSURES(!size_class.free_cells && size_class.unswept == size_class.pages);
+      if (!size_class.pages || !size_class.pages->next) {
+        continue;
+      }
+      for (auto link = &size_class.pages; *link;) {
+        const auto page = *link;
+        if (count_marked(page) * evacuation_ratio >=
+            cells_per_page(page->cell_size)) {
+          link = &page->next;
+          continue;
+        }
+        *link = page->next;
+        page->next = evacuating;
+        page->evacuating = true;
+        evacuating = page;
+        --count;
+        for_each_allocated(page, [&](std::byte* cell) {
+          if (!page->test(&Page::marks, cell)) {
+            finalize(cell);
+            page->reset(&Page::allocated, cell);
+          }
+        });
+      }
+      size_class.unswept = size_class.pages;
+    }
+  }
+
+  template <typename Visitor>
+  void for_each_evacuee(Visitor&& visitor) noexcept {
+    for (auto page = evacuating; page; page = page->next) {
+      for_each_allocated(page, visitor);
+    }
+  }
+
+  void release_evacuated() noexcept {
+    while (evacuating) {
+      const auto next = evacuating->next;
+      std::free(evacuating);
+      evacuating = next;
+    }
+  }
+
+  // Visits every old cell in use. Sweeping must have finished.
+  template <typename Visitor>
+  void for_each_old_cell(Visitor&& visitor) noexcept {
+    for (auto& size_class : size_classes) {
+      ENSURES(!size_class.unswept);
+      for (auto page = size_class.pages; page; page = page->next) {
+        for_each_allocated(page, visitor);
+      }
+    }
+    for (auto page = large_pages; page; page = page->next) {
+      visitor(page->begin());
+    }
+  }
+
+  static constexpr size_t cell_size_of(size_t size) noexcept {
+    return (class_of(size) + 1) * granularity;
+  }
+
+ private:
+  static constexpr size_t bitmap_words = page_size / granularity / 64;
+  using Bitmap = std::array<uint64_t, bitmap_words>;
+
+  struct Page {
+    Page* next;
+    size_t cell_size;
+    bool young = false;
+    bool evacuating = false;
+    Bitmap allocated{};
+    Bitmap marks{};
+    Bitmap remembered{};
+
+    std::byte* begin() noexcept {
+      return reinterpret_cast<std::byte*>(this) + header_size;
+    }
+    std::byte* end() noexcept {
+      return reinterpret_cast<std::byte*>(this) + page_size;
+    }
+
+    bool test(Bitmap Page::*bitmap, const void* cell) const noexcept {
+      const auto index = index_of(cell);
+      return ((this->*bitmap)[index / 64] >> (index % 64)) & 1;
+    }
+    void set(Bitmap Page::*bitmap, const void* cell) noexcept {
+      const auto index = index_of(cell);
+      (this->*bitmap)[index / 64] |= uint64_t{1} << (index % 64);
+    }
+    bool test_and_set_atomic(Bitmap Page::*bitmap, const void* cell) noexcept {
+      const auto index = index_of(cell);
+      const auto bit = uint64_t{1} << (index % 64);
+      auto& word = (this->*bitmap)[index / 64];
+      return (__atomic_load_n(&word, __ATOMIC_RELAXED) & bit) ||
+             (__atomic_fetch_or(&word, bit, __ATOMIC_RELAXED) & bit);
+    }
+    void reset(Bitmap Page::*bitmap, const void* cell) noexcept {
+      const auto index = index_of(cell);
+      (this->*bitmap)[index / 64] &= ~(uint64_t{1} << (index % 64));
+    }
+
+    size_t index_of(const void* cell) const noexcept {
+      return static_cast<size_t>(static_cast<const std::byte*>(cell) -
+                                 reinterpret_cast<const std::byte*>(this)) /
+             granularity;
+    }
+  };
+
+  struct Free_cell {
+    Free_cell* next;
+  };
+
+  struct Size_class {
+    Page* pages = nullptr;
+    Page* unswept = nullptr;
+    Free_cell* free_cells = nullptr;
+    std::byte* bump = nullptr;
+    std::byte* limit = nullptr;
+  };
+
+  static constexpr size_t header_size =
+      (sizeof(Page) + granularity - 1) / granularity * granularity;
+
+  static constexpr size_t evacuation_ratio = 4;
+
+  static constexpr size_t class_of(size_t size) noexcept {
+    return size == 0 ? 0 : (size - 1) / granularity;
+  }
+
+  static constexpr size_t cells_per_page(size_t cell_size) noexcept {
+    return (page_size - header_size) / cell_size;
+  }
+
+  static Page* page_of(const void* cell) noexcept {
+    return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(cell) &
+                                   ~(page_size - 1));
+  }
+
+  Page* new_page(Page* next, size_t cell_size, size_t size,
+                 bool young = false) noexcept {
+    const auto memory = std::aligned_alloc(page_size, size);
+    ENSURES(memory);
+    return new (memory) Page{next, cell_size, young};
+  }
+
+  void next_nursery_page() noexcept {
+    if (nursery_bump) {
+      ++nursery_current;
+    }
+    if (nursery_current == nursery.size()) {
+      nursery.push_back(new_page(nullptr, granularity, page_size, true));
+    }
+    nursery_bump = nursery[nursery_current]->begin();
+    nursery_limit = nursery[nursery_current]->end();
+  }
+
+  template <typename Visitor>
+  static void for_each_allocated(Page* page, Visitor&& visitor) noexcept {
+    for (size_t word = 0; word < bitmap_words; ++word) {
+      for (auto bits = page->allocated[word]; bits != 0; bits &= bits - 1) {
+        const auto index = word * 64 + __builtin_ctzll(bits);
+        visitor(reinterpret_cast<std::byte*>(page) + index * granularity);
+      }
+    }
+  }
+
+  static size_t count_marked(const Page* page) noexcept {
+    size_t marked = 0;
+    for (auto word : page->marks) {
+      marked += __builtin_popcountll(word);
+    }
+    return marked;
+  }
+
+  void finalize_young(Page* page) const noexcept {
+    for_each_allocated(page, [&](std::byte* cell) {
+      if (!page->test(&Page::marks, cell)) {
+        finalize(cell);
+      }
+    });
+  }
+
+  void* allocate_large(size_t size) noexcept {
+    const auto pages_size =
+        (header_size + size + page_size - 1) / page_size * page_size;
+    large_pages = new_page(large_pages, size, pages_size);
+    const auto cell = large_pages->begin();
+    large_pages->set(&Page::allocated, cell);
+    return cell;
+  }
+
+  // Finalizes the dead cells of the next unswept page and puts every cell that
+  // is free now onto the free list of its size class, last cell first so that
+  // they are handed out again in address order.
+  void sweep_page(Size_class& size_class) noexcept {
+    const auto page = size_class.unswept;
+    size_class.unswept = page->next;
+    auto free_cells = size_class.free_cells;
+    for (auto i = cells_per_page(page->cell_size); i-- > 0;) {
+      const auto cell = page->begin() + i * page->cell_size;
+      if (page->test(&Page::allocated, cell)) {
+        if (page->test(&Page::marks, cell)) {
+          continue;
+        }
+        finalize(cell);
+        page->reset(&Page::allocated, cell);
+      }
+      free_cells = new (cell) Free_cell{free_cells};
+    }
+    page->marks = Bitmap{};
+    size_class.free_cells = free_cells;
+  }
+
+  void finalize(void* cell) const noexcept {
+    if (finalizer) {
+      finalizer(cell);
+    }
+  }
+
+  void release_pages(Page*& pages) noexcept {
+    while (pages) {
+      const auto next = pages->next;
+      for (size_t i = 0; i < cells_per_page(pages->cell_size); ++i) {
+        if (const auto cell = pages->begin() + i * pages->cell_size;
+            pages->test(&Page::allocated, cell)) {
+          finalize(cell);
+        }
+      }
+      std::free(pages);
+      pages = next;
+    }
+  }
+
+  static void unlink_page(Page*& pages, Page* page) noexcept {
+    for (auto link = &pages; *link; link = &(*link)->next) {
+      if (*link == page) {
+        *link = page->next;
+        return;
+      }
+    }
+  }
+
+  Finalizer finalizer;
+  std::array<Size_class, max_small_size / granularity> size_classes{};
+  Page* large_pages = nullptr;
+  Page* evacuating = nullptr;
+  std::vector<Page*> nursery;
+  size_t nursery_current = 0;
+  std::byte* nursery_bump = nullptr;
+  std::byte* nursery_limit = nullptr;
+  size_t count = 0;
+};
+
+}  // namespace lox
+
+#endif
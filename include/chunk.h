@@ -1,6 +1,8 @@
 #ifndef LOX_CHUNK_H
 #define LOX_CHUNK_H
 
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 
 #include "contract.h"
@@ -10,12 +12,19 @@
 namespace lox {
 
 struct Chunk {
+  // Line information is run-length encoded: a run covers the code from its
+  // start up to the start of the next run.
+  struct Line_run {
+    uint32_t start;
+    uint32_t line;
+  };
+  using Line_run_vector = std::vector<Line_run>;
+
   template <typename Instruction>
   size_t add(size_t line) noexcept {
     const auto pos = code.size();
     code.push_back(Instruction::opcode);
-    lines.push_back(line);
-    EXPECTS(code.size() == lines.size());
+    add_line(pos, line);
     return pos;
   }
 
@@ -24,26 +33,7 @@ struct Chunk {
     static_assert(Instruction::size > instruction::Simple_instr::size);
 
     const auto pos = add<Instruction>(line);
-    const auto count = Instruction::add_operand(code, operand);
-    for (size_t i = 0; i < count; ++i) {
-      lines.push_back(line);
-    }
-    EXPECTS(code.size() == lines.size());
-    return pos;
-  }
-
-  template <typename Instruction>
-  size_t add(size_t operand,
-             const typename Instruction::Upvalue_vector &upvalues,
-             size_t line) noexcept {
-    static_assert(std::is_base_of_v<instruction::Closure_instr, Instruction>);
-
-    const auto pos = add<Instruction>(operand, line);
-    const auto count = Instruction::add_upvalues(code, upvalues);
-    for (size_t i = 0; i < count; ++i) {
-      lines.push_back(line);
-    }
-    EXPECTS(code.size() == lines.size());
+    Instruction::add_operand(code, operand);
     return pos;
   }
 
@@ -65,19 +55,54 @@ struct Chunk {
   const Value_vector &get_constants() const noexcept { return constants; }
   Value_vector &get_constants() noexcept { return constants; }
 
+  bool has_lines() const noexcept { return !stripped; }
+
+  // Returns 0 when the chunk carries no line information.
   size_t line_at(size_t pos) const noexcept {
-    ENSURES(pos < lines.size());
-    return lines[pos];
+    ENSURES(pos < code.size());
+    const auto it = std::upper_bound(
+        lines.cbegin(), lines.cend(), pos,
+        [](size_t position, const Line_run &run) {
+          return position < run.start;
+        });
+    return it != lines.cbegin() ? std::prev(it)->line : 0;
+  }
+
+  void strip_lines() noexcept {
+    stripped = true;
+    lines = Line_run_vector{};
+  }
+
+  const Bytecode_vector &get_code() const noexcept { return code; }
+  const Line_run_vector &get_lines() const noexcept { return lines; }
+
+  void assign(Bytecode_vector new_code, Line_run_vector new_lines) noexcept {
+    code = std::move(new_code);
+    lines = std::move(new_lines);
+    stripped = lines.empty() && !code.empty();
+  }
+
+  // Bytes of the buffers the chunk holds outside itself.
+  size_t owned_bytes() const noexcept {
+    return code.capacity() * sizeof(Bytecode) +
+           constants.capacity() * sizeof(Value) +
+           lines.capacity() * sizeof(Line_run);
   }
 
   std::string to_string(const std::string &name, int level = 0) const noexcept;
 
  private:
-  using Line_vector = std::vector<size_t>;
+  void add_line(size_t pos, size_t line) noexcept {
+    if (!stripped && (lines.empty() || lines.back().line != line)) {
+      lines.push_back(
+          {static_cast<uint32_t>(pos), static_cast<uint32_t>(line)});
+    }
+  }
 
   Bytecode_vector code;
   Value_vector constants;
-  Line_vector lines;
+  Line_run_vector lines;
+  bool stripped = false;
 };
 
 }  // namespace lox
@@ -1,12 +1,18 @@
 #ifndef LOX_COMPILER_H
 #define LOX_COMPILER_H
 
+#include <algorithm>
 #include <array>
+#include <cstdlib>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
 #include "chunk.h"
 #include "exception.h"
 #include "heap.h"
+#include "options.h"
 #include "scanner.h"
 
 namespace lox {
@@ -84,28 +90,65 @@ struct Rules_generator {
 
 class Compiler {
  public:
-  explicit Compiler(Heap &heap) noexcept : heap{&heap} {}
+  explicit Compiler(Heap &heap, Compile_options options = {}) noexcept
+      : heap{&heap}, options{options} {}
 
   Function *compile(Token_vector ts) {
+    Arena_scope scope{*this};
+    tokens = &ts;
+    current = tokens->cbegin();
     make_func_frame("", 0);
-    tokens = std::move(ts);
-    current = tokens.cbegin();
     while (!match(Token::eof)) {
       parse_declaration();
     }
     add_return_instruction();
     EXPECTS(func_frames.size() == 1)
-    return func_frames.back().func;
+    const auto func = current_func_frame->func;
+    pop_func_frame();
+    return func;
+  }
+
+  void compile(Function &func) {
+    Arena_scope scope{*this};
+    const auto body = func.take_body();
+    tokens = &body;
+    current = tokens->cbegin();
+    previous = current;
+    push_func_frame(&func, 1);
+    parse_function_header();
+    parse_block();
+    add_return_instruction();
+    ENSURES(check(Token::eof));
+    ENSURES(func.captures.empty());
+    pop_func_frame();
   }
 
   template <typename Visitor>
-  void for_each_func(Visitor &&visitor) const noexcept {
-    for (const auto &func_frame : func_frames) {
+  void for_each_func(Visitor &&visitor) noexcept {
+    for (auto &func_frame : func_frames) {
       visitor(func_frame.func);
     }
   }
 
  private:
+  using Symbol = uint32_t;
+  using Symbol_map = std::pmr::unordered_map<std::pmr::string, Symbol>;
+  using Symbol_index = std::pmr::unordered_map<Symbol, int>;
+
+  // Everything a compilation allocates besides the objects it produces lives
+  // in the arena, which is released in one step when the compilation ends.
+  class Arena_scope {
+   public:
+    explicit Arena_scope(Compiler &compiler) noexcept : compiler{&compiler} {}
+    ~Arena_scope() noexcept { compiler->release_arena(); }
+
+    Arena_scope(const Arena_scope &) = delete;
+    Arena_scope &operator=(const Arena_scope &) = delete;
+
+   private:
+    Compiler *compiler;
+  };
+
   void parse_declaration() {
     if (match(Token::k_func)) {
       parse_func_declaration();
@@ -120,32 +163,54 @@ class Compiler {
     const auto name = parse_variable("Expect function name.");
     current_func_frame->initial_latest_local();
     parse_function();
+    // A function that refers to itself captures its local before the closure
+    // is stored there, so it has to share the local rather than copy it.
+    if (auto &frame = *current_func_frame;
+        frame.scope_depth > 0 && frame.locals.back().is_captured) {
+      frame.locals.back().is_assigned = true;
+    }
     current_func_frame->define_variable(name, previous->line);
   }
 
   void parse_function() {
+    // Only functions declared at the top level of the script are deferred: they
+    // cannot capture any local, so their closures never need upvalues.
+    const auto lazy = options.lazy_functions && func_frames.size() == 1 &&
+                      current_func_frame->scope_depth == 0;
     make_func_frame(previous->lexeme, 1);
+    const auto begin = current;
+    parse_function_header();
+    if (lazy && !options.verify_lazy_functions) {
+      skip_block();
+    } else {
+      parse_block();
+      add_return_instruction();
+    }
+
+    const auto func = current_func_frame->func;
+    if (lazy) {
+      Token_vector body(begin, current);
+      body.emplace_back(Token::eof, previous->line);
+      func->defer(std::move(body));
+    }
+    pop_func_frame();
+    add<instruction::Closure>(add_constant(func));
+  }
+
+  void parse_function_header() {
     current_func_frame->begin_scope();
     consume(Token::left_paren, "Expect '(' after function name.");
 
     parse_parameters();
 
     consume(Token::left_brace, "Expect '{' before function body.");
-    parse_block();
-
-    add_return_instruction();
-    const auto func = current_func_frame->func;
-    const auto upvalues = std::move(current_func_frame->upvalues);
-    pop_func_frame();
-    add<instruction::Closure>(add_constant(func), upvalues);
   }
 
   void parse_parameters() {
+    size_t arity = 0;
     if (!check(Token::right_paren)) {
       do {
-        auto func = current_func_frame->func;
-        func->inc_arity();
-        if (func->get_arity() > max_function_parameters) {
+        if (++arity > max_function_parameters) {
           throw make_compile_error("Cannot have more than " +
                                        std::to_string(max_function_parameters) +
                                        " parameters.",
@@ -155,6 +220,7 @@ class Compiler {
         current_func_frame->define_variable(parameter, previous->line);
       } while (match(Token::comma));
     }
+    current_func_frame->func->set_arity(arity);
     consume(Token::right_paren, "Expect ')' after parameters.");
   }
 
@@ -171,7 +237,8 @@ class Compiler {
 
   size_t parse_variable(const std::string &message) {
     consume(Token::identifier, message);
-    current_func_frame->declare_variable(*previous);
+    current_func_frame->declare_variable(*previous,
+                                         symbol_of(previous->lexeme));
     if (current_func_frame->scope_depth > 0) {
       return 0;
     }
@@ -286,6 +353,20 @@ class Compiler {
     consume(Token::right_brace, "Expect '}' after block.");
   }
 
+  void skip_block() {
+    for (size_t depth = 1; depth > 0;) {
+      if (check(Token::eof)) {
+        consume(Token::right_brace, "Expect '}' after block.");
+      }
+      advance();
+      if (previous->type == Token::left_brace) {
+        ++depth;
+      } else if (previous->type == Token::right_brace) {
+        --depth;
+      }
+    }
+  }
+
   void parse_print() {
     parse_expression();
     consume(Token::semicolon, "Expect ';' after value.");
@@ -424,9 +505,10 @@ class Compiler {
 
   void add_variable(bool can_assign) {
     auto type = Variable_type::local;
-    auto index = current_func_frame->resolve_local(*previous);
+    const auto symbol = symbol_of(previous->lexeme);
+    auto index = current_func_frame->resolve_local(*previous, symbol);
     if (index == -1) {
-      index = resolve_upvalue(previous->lexeme, func_frames.size() - 1);
+      index = resolve_upvalue(symbol, func_frames.size() - 1);
       if (index != -1) {
         type = Variable_type::upvalue;
       } else {
@@ -435,6 +517,7 @@ class Compiler {
       }
     }
     if (can_assign && match(Token::equal)) {
+      mark_assigned(type, index, symbol);
       parse_expression();
       add_variable<Variable_set>(type, index);
     } else {
@@ -442,6 +525,23 @@ class Compiler {
     }
   }
 
+  // Through an upvalue, the assigned local is the one the name resolves to in
+  // the nearest enclosing frame that has it.
+  void mark_assigned(Variable_type type, int index, Symbol symbol) {
+    if (type == Variable_type::local) {
+      current_func_frame->locals[index].is_assigned = true;
+    } else if (type == Variable_type::upvalue) {
+      for (auto i = func_frames.size() - 1; i-- > 0;) {
+        auto &frame = func_frames[i];
+        if (const auto local = frame.resolve_local(*previous, symbol);
+            local != -1) {
+          frame.locals[local].is_assigned = true;
+          return;
+        }
+      }
+    }
+  }
+
   template <typename Variable_get_set>
   void add_variable(Variable_type type, size_t index) {
     if constexpr (std::is_same_v<Variable_get_set, Variable_get>) {
@@ -471,25 +571,36 @@ class Compiler {
     }
   }
 
-  int resolve_upvalue(const std::string &name, size_t frame_index) {
-    if (frame_index > 0) {
-      ENSURES(frame_index < func_frames.size());
-      auto &previous_frame = func_frames[frame_index - 1];
-      if (const auto local = previous_frame.resolve_local(*previous);
-          local != -1) {
-        previous_frame.locals[local].is_captured = true;
-        return func_frames[frame_index].add_upvalue(local, true, *previous);
-      }
-      if (const auto upvalue = resolve_upvalue(name, frame_index - 1);
-          upvalue != -1) {
-        return func_frames[frame_index].add_upvalue(upvalue, false, *previous);
-      }
+  // The enclosing frames of a frame do not change while it is compiled, so
+  // the outcome of resolving a name from it, found or not, is cached.
+  int resolve_upvalue(Symbol symbol, size_t frame_index) {
+    if (frame_index == 0) {
+      return -1;
+    }
+    ENSURES(frame_index < func_frames.size());
+    auto &frame = func_frames[frame_index];
+    if (const auto it = frame.resolved_upvalues.find(symbol);
+        it != frame.resolved_upvalues.cend()) {
+      return it->second;
     }
-    return -1;
+    int index = -1;
+    auto &previous_frame = func_frames[frame_index - 1];
+    if (const auto local = previous_frame.resolve_local(*previous, symbol);
+        local != -1) {
+      previous_frame.locals[local].is_captured = true;
+      index = frame.add_upvalue(local, true, *previous);
+      previous_frame.local_captures.push_back({local, frame.func, index});
+    } else if (const auto upvalue = resolve_upvalue(symbol, frame_index - 1);
+               upvalue != -1) {
+      index = frame.add_upvalue(upvalue, false, *previous);
+    }
+    frame.resolved_upvalues.emplace(symbol, index);
+    return index;
   }
 
   void add_number_constant(bool) {
-    add<instruction::Constant>(add_constant(std::stod(previous->lexeme)));
+    add<instruction::Constant>(
+        add_constant(std::strtod(previous->lexeme.c_str(), nullptr)));
   }
   void add_string_constant(bool) {
     add<instruction::Constant>(
@@ -563,14 +674,6 @@ class Compiler {
     return chunk.add<Instruction>(operand, previous->line);
   }
 
-  template <typename Instruction>
-  size_t add(size_t operand,
-             const typename Instruction::Upvalue_vector &upvalues) noexcept {
-    ENSURES(!func_frames.empty() && func_frames.back().func);
-    auto &chunk = func_frames.back().func->get_chunk();
-    return chunk.add<Instruction>(operand, upvalues, previous->line);
-  }
-
   template <typename... Args>
   size_t add_constant(Args &&... args) {
     ENSURES(!func_frames.empty() && func_frames.back().func);
@@ -592,39 +695,64 @@ class Compiler {
     return current_func_frame->get_chunk().code_size();
   }
 
+  Symbol symbol_of(const std::pmr::string &name) {
+    // Look up first: emplace would copy the name into the arena every time.
+    if (const auto it = symbols.find(name); it != symbols.cend()) {
+      return it->second;
+    }
+    return symbols.emplace(name, symbols.size()).first->second;
+  }
+
   struct Local {
-    Local(std::string name, int depth) noexcept
-        : name{std::move(name)}, depth{depth} {}
+    Local(Symbol symbol, int depth, int shadowed) noexcept
+        : symbol{symbol}, depth{depth}, shadowed{shadowed} {}
 
-    std::string name;
+    Symbol symbol;
     int depth;
+    // Index of the local with the same name that this one hides, or -1.
+    int shadowed;
     bool is_captured = false;
+    // Assigned anywhere after its declaration, directly or through upvalues.
+    bool is_assigned = false;
   };
-  using Local_vector = std::vector<Local>;
+  using Local_vector = std::pmr::vector<Local>;
+
+  // A local of a frame captured by a function nested in it, as the capture at
+  // index of that function.
+  struct Local_capture {
+    int local;
+    Function *func;
+    int index;
+  };
+  using Local_capture_vector = std::pmr::vector<Local_capture>;
 
   struct Func_frame {
-    Func_frame(Function *func, int depth) noexcept
-        : func{func}, scope_depth{depth} {
+    Func_frame(Function *func, int depth,
+               std::pmr::memory_resource *resource) noexcept
+        : func{func},
+          locals{resource},
+          local_index{resource},
+          resolved_upvalues{resource},
+          local_captures{resource},
+          scope_depth{depth} {
       ENSURES(func);
-      locals.emplace_back("function object", depth);
+      locals.emplace_back(no_symbol, depth, -1);
     }
 
     Chunk &get_chunk() noexcept { return func->get_chunk(); }
 
-    void declare_variable(const Token &token) {
-      const auto &name = token.lexeme;
+    void declare_variable(const Token &token, Symbol symbol) {
       if (scope_depth > 0) {
-        for (auto it = locals.crbegin(); it != locals.crend(); ++it) {
-          if (it->depth != -1 && it->depth < scope_depth) {
-            break;
-          }
-          if (it->name == name) {
+        if (const auto it = local_index.find(symbol);
+            it != local_index.cend()) {
+          if (const auto depth = locals[it->second].depth;
+              depth == -1 || depth >= scope_depth) {
             throw make_compile_error(
                 "Variable with this name already declared in this scope.",
                 token);
           }
         }
-        add_local(name, token);
+        add_local(symbol, token);
       }
     }
 
@@ -643,23 +771,23 @@ class Compiler {
       }
     }
 
-    int resolve_local(const Token &token) const {
-      const auto &name = token.lexeme;
-      for (int i = locals.size() - 1; i >= 0; --i) {
-        if (locals[i].name == name) {
-          if (locals[i].depth != -1) {
-            return i;
-          }
-          throw make_compile_error(
-              "Cannot read local variable in its own initializer.", token);
+    int resolve_local(const Token &token, Symbol symbol) const {
+      if (const auto it = local_index.find(symbol); it != local_index.cend()) {
+        if (locals[it->second].depth != -1) {
+          return it->second;
         }
+        throw make_compile_error(
+            "Cannot read local variable in its own initializer.", token);
       }
       return -1;
     }
 
-    void add_local(std::string name, const Token &token) {
+    void add_local(Symbol symbol, const Token &token) {
       if (locals.size() <= UINT8_MAX) {
-        locals.emplace_back(std::move(name), -1);
+        const auto [it, inserted] = local_index.emplace(symbol, locals.size());
+        const auto shadowed = inserted ? -1 : it->second;
+        it->second = locals.size();
+        locals.emplace_back(symbol, -1, shadowed);
       } else {
         throw make_compile_error("Too many local variables in function.",
                                  token);
@@ -670,25 +798,59 @@ class Compiler {
     void end_scope(int line) noexcept {
       --scope_depth;
       while (!locals.empty() && locals.back().depth > scope_depth) {
-        if (const auto &local = locals.back(); local.is_captured) {
+        const auto &local = locals.back();
+        if (local.is_captured && settle_captures(locals.size() - 1)) {
           get_chunk().add<instruction::Close_upvalue>(line);
         } else {
           get_chunk().add<instruction::Pop>(line);
         }
+        if (local.shadowed != -1) {
+          local_index[local.symbol] = local.shadowed;
+        } else {
+          local_index.erase(local.symbol);
+        }
         locals.pop_back();
       }
     }
 
-    size_t add_upvalue(size_t index, bool is_local, const Token &token) {
-      for (size_t i = 0; i < upvalues.size(); ++i) {
-        if (upvalues[i].index == index && upvalues[i].is_local == is_local) {
-          return i;
+    // A captured local that is never assigned keeps its value for as long as
+    // it lives, so the closures capturing it copy the value instead of sharing
+    // an upvalue. Called once the local goes out of scope, when that is known;
+    // returns whether upvalues were made for it and need closing.
+    bool settle_captures(int local) noexcept {
+      const auto is_final = !locals[local].is_assigned;
+      local_captures.erase(
+          std::remove_if(local_captures.begin(), local_captures.end(),
+                         [&](const Local_capture &capture) {
+                           if (capture.local != local) {
+                             return false;
+                           }
+                           capture.func->captures[capture.index].is_final =
+                               is_final;
+                           return true;
+                         }),
+          local_captures.end());
+      return !is_final;
+    }
+
+    // The locals still in scope when the function ends are closed by its
+    // return.
+    void settle_all_captures() noexcept {
+      for (auto local = static_cast<int>(locals.size()) - 1; local >= 0;
+           --local) {
+        if (locals[local].is_captured) {
+          settle_captures(local);
         }
       }
-      if (upvalues.size() <= UINT8_MAX) {
-        upvalues.emplace_back(index, is_local);
-        func->upvalue_count = upvalues.size();
-        return func->upvalue_count - 1;
+    }
+
+    // Called once per name and frame, see resolve_upvalue, and two names never
+    // resolve to the same enclosing variable, so no duplicate check is needed.
+    size_t add_upvalue(size_t index, bool is_local, const Token &token) {
+      if (auto &captures = func->captures; captures.size() <= UINT8_MAX) {
+        ENSURES(index <= UINT8_MAX);
+        captures.push_back({static_cast<uint8_t>(index), is_local});
+        return captures.size() - 1;
       }
       throw make_compile_error("Too many closure variables in function.",
                                token);
@@ -696,26 +858,46 @@ class Compiler {
 
     Function *func;
     Local_vector locals;
-    instruction::Closure::Upvalue_vector upvalues;
+    Symbol_index local_index;
+    Symbol_index resolved_upvalues;
+    Local_capture_vector local_captures;
     int scope_depth;
   };
 
-  using Func_frame_vector = std::vector<Func_frame>;
+  using Func_frame_vector = std::pmr::vector<Func_frame>;
 
-  void make_func_frame(const std::string &name, int depth) noexcept {
+  void make_func_frame(std::string_view name, int depth) noexcept {
     auto func = heap->make_object<Function>();
-    func_frames.emplace_back(func, depth);
+    push_func_frame(func, depth);
     if (!name.empty()) {
       func->name = heap->make_string(name);
     }
+  }
+
+  void push_func_frame(Function *func, int depth) noexcept {
+    if (options.strip_debug_info) {
+      func->get_chunk().strip_lines();
+    }
+    func_frames.emplace_back(func, depth, &arena);
     current_func_frame = &func_frames.back();
   }
 
   void pop_func_frame() noexcept {
+    current_func_frame->settle_all_captures();
     func_frames.pop_back();
     current_func_frame = func_frames.empty() ? nullptr : &func_frames.back();
   }
 
+  // The containers are replaced rather than cleared: a cleared container would
+  // keep its capacity, which points into the released arena.
+  void release_arena() noexcept {
+    func_frames = Func_frame_vector{&arena};
+    current_func_frame = nullptr;
+    symbols = Symbol_map{&arena};
+    tokens = nullptr;
+    arena.release();
+  }
+
   static Compile_error make_compile_error(const std::string &message,
                                           const Token &token) noexcept;
 
@@ -727,11 +909,16 @@ class Compiler {
       precedence::Rules_generator<Compiler>::make_rules();
 
   constexpr static int max_function_parameters = UINT8_MAX;
+  // The slot of the called function, which no identifier can name.
+  constexpr static Symbol no_symbol = UINT32_MAX;
 
   Heap *heap;
-  Func_frame_vector func_frames;
+  Compile_options options;
+  std::pmr::monotonic_buffer_resource arena;
+  Func_frame_vector func_frames{&arena};
   Func_frame *current_func_frame = nullptr;
-  Token_vector tokens;
+  Symbol_map symbols{&arena};
+  const Token_vector *tokens = nullptr;
   Token_vector::const_iterator current;
   Token_vector::const_iterator previous;
 };
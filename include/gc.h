@@ -1,17 +1,142 @@
 #ifndef LOX_GC_H
 #define LOX_GC_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "contract.h"
 #include "object.h"
+#include "options.h"
 #include "value.h"
+#include "work_stealing_deque.h"
 
 namespace lox {
 
+class Pause_recorder {
+ public:
+  using Duration = std::chrono::steady_clock::duration;
+
+  void record(Duration pause) noexcept { pauses.push_back(pause); }
+
+  size_t count() const noexcept { return pauses.size(); }
+
+  Duration max() const noexcept {
+    return pauses.empty() ? Duration{}
+                          : *std::max_element(pauses.cbegin(), pauses.cend());
+  }
+
+  // The shortest pause that is at least as long as the given fraction of all
+  // pauses, e.g. percentile(0.99) for the p99 pause.
+  Duration percentile(double fraction) const noexcept {
+    EXPECTS(fraction >= 0 && fraction <= 1);
+    if (pauses.empty()) {
+      return Duration{};
+    }
+    auto sorted = pauses;
+    const auto rank = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+  }
+
+  // Bucket i counts the pauses shorter than 2^i microseconds and not counted
+  // in a lower bucket; the last bucket also counts all longer pauses.
+  static constexpr size_t histogram_buckets = 16;
+  std::array<size_t, histogram_buckets> histogram() const noexcept {
+    std::array<size_t, histogram_buckets> buckets{};
+    for (const auto pause : pauses) {
+      const auto micros =
+          std::chrono::duration_cast<std::chrono::microseconds>(pause).count();
+      size_t bucket = 0;
+      while (bucket < histogram_buckets - 1 && micros >= (1ll << bucket)) {
+        ++bucket;
+      }
+      ++buckets[bucket];
+    }
+    return buckets;
+  }
+
+ private:
+  std::vector<Duration> pauses;
+};
+
+struct Gc_stats {
+  size_t young_collections = 0;
+  size_t full_collections = 0;
+  // Totals over the lifetime of the collector; their difference is the heap
+  // size now.
+  size_t bytes_allocated = 0;
+  size_t bytes_freed = 0;
+  // Counted by the last full collection.
+  std::array<size_t, Object::Types::size> live_objects{};
+  size_t interned_strings = 0;
+  Pause_recorder pauses;
+
+  size_t heap_bytes() const noexcept { return bytes_allocated - bytes_freed; }
+
+  // Visits every statistic as a name and a number.
+  template <typename Visitor>
+  void for_each(Visitor&& visitor) const noexcept {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    static constexpr const char* type_names[] = {
+        "live_strings", "live_ropes",    "live_functions",
+        "live_natives", "live_upvalues", "live_closures"};
+    static_assert(std::size(type_names) == Object::Types::size);
+
+    visitor("young_collections", young_collections);
+    visitor("full_collections", full_collections);
+    visitor("bytes_allocated", bytes_allocated);
+    visitor("bytes_freed", bytes_freed);
+    visitor("heap_bytes", heap_bytes());
+    for (size_t i = 0; i < live_objects.size(); ++i) {
+      visitor(type_names[i], live_objects[i]);
+    }
+    visitor("interned_strings", interned_strings);
+    visitor("pauses", pauses.count());
+    visitor("p99_pause_us",
+            duration_cast<microseconds>(pauses.percentile(0.99)).count());
+    visitor("max_pause_us", duration_cast<microseconds>(pauses.max()).count());
+  }
+};
+
 class Memory_tracker {
  public:
-  Memory_tracker() noexcept { current_tracker = this; }
+  class Pause_guard {
+   public:
+    Pause_guard() noexcept : tracker{current()} {
+      if (tracker) {
+        ++tracker->pause_depth;
+      }
+    }
+    ~Pause_guard() noexcept {
+      if (tracker) {
+        --tracker->pause_depth;
+      }
+    }
+
+    Pause_guard(const Pause_guard&) noexcept = delete;
+    Pause_guard& operator=(const Pause_guard&) noexcept = delete;
+
+   private:
+    Memory_tracker* tracker;
+  };
+
+  explicit Memory_tracker(const Gc_options& options = {}) noexcept
+      : max_pause{options.max_pause},
+        heap_grow_factor{options.heap_grow_factor},
+        min_heap{options.min_heap},
+        max_heap{options.max_heap},
+        next_gc{options.initial_heap} {
+    EXPECTS(heap_grow_factor >= 1);
+    current_tracker = this;
+  }
 
   virtual ~Memory_tracker() noexcept { current_tracker = nullptr; }
 
@@ -24,45 +149,308 @@ class Memory_tracker {
 
   void allocate(size_t size) noexcept {
     bytes_allocated += size;
-    if (bytes_allocated > next_gc) {
-      collect_garbage();
-      next_gc = bytes_allocated * 2;
+    stats.bytes_allocated += size;
+  }
+  void free(size_t size) noexcept {
+    bytes_allocated -= size;
+    stats.bytes_freed += size;
+  }
+
+  void request_young_collection() noexcept {
+    young_collection_requested = true;
+  }
+
+  bool is_collection_requested() const noexcept {
+    return pause_depth == 0 &&
+           (young_collection_requested ||
+            (marking ? bytes_allocated >= next_mark_step
+                     : bytes_allocated > next_gc));
+  }
+
+  // Collections only happen here, and the VM only calls it at safepoints, where
+  // every object pointer it holds is reachable from the roots. Objects may
+  // move, so everything cached from them has to be reloaded afterwards.
+  //
+  // The old generation is marked incrementally: a cycle starts once
+  // next_gc is exceeded and then advances by one bounded step for every
+  // mark_slice bytes allocated and every young collection.
+  void collect_if_requested() noexcept {
+    if (!is_collection_requested()) {
+      return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    if (std::exchange(young_collection_requested, false)) {
+      collect_young();
+    }
+    if (!marking && bytes_allocated > next_gc) {
+      begin_marking();
+      marking = true;
+    }
+    if (marking) {
+      // Marking that falls this far behind the program finishes at once.
+      const auto behind = bytes_allocated > next_gc * heap_grow_factor;
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      if (behind || mark_step(max_pause - elapsed)) {
+        finish_cycle();
+      } else {
+        next_mark_step = bytes_allocated + mark_slice;
+      }
     }
+    stats.pauses.record(std::chrono::steady_clock::now() - start);
   }
-  void free(size_t size) noexcept { bytes_allocated -= size; }
+
+  // Collects both generations at once, finishing the current marking cycle
+  // if there is one, and returns the number of bytes freed.
+  size_t collect_garbage() noexcept {
+    if (!marking) {
+      begin_marking();
+      marking = true;
+    }
+    return finish_cycle();
+  }
+
+  const Pause_recorder& get_pauses() const noexcept { return stats.pauses; }
+  const Gc_stats& get_stats() const noexcept { return stats; }
+
+ protected:
+  bool is_marking() const noexcept { return marking; }
+
+  Gc_stats stats;
 
  private:
-  virtual void collect_garbage() noexcept = 0;
+  virtual void collect_young() noexcept = 0;
+  virtual void begin_marking() noexcept = 0;
+  // Returns true when there is no gray object left.
+  virtual bool mark_step(Pause_recorder::Duration budget) noexcept = 0;
+  // Rescans the roots, completes marking and returns the bytes swept.
+  virtual size_t finish_marking() noexcept = 0;
 
-  static constexpr size_t initial_gc = 1024 * 1024;
-  static constexpr size_t heap_grow_factor = 2;
+  size_t finish_cycle() noexcept {
+    const auto freed = finish_marking();
+    marking = false;
+    bytes_allocated -= freed;
+    stats.bytes_freed += freed;
+    ++stats.full_collections;
+    next_gc = std::max(
+        static_cast<size_t>(bytes_allocated * heap_grow_factor), min_heap);
+    if (max_heap > 0 && next_gc > max_heap) {
+      // Past the limit, collect again after every slice of allocation.
+      next_gc = std::max(max_heap, bytes_allocated + mark_slice);
+    }
+    return freed;
+  }
+
+  static constexpr size_t mark_slice = 64 * 1024;
 
   inline static Memory_tracker* current_tracker = nullptr;
 
+  Pause_recorder::Duration max_pause;
+  double heap_grow_factor;
+  size_t min_heap;
+  size_t max_heap;
   size_t bytes_allocated = 0;
-  size_t next_gc = initial_gc;
+  size_t next_gc;
+  size_t next_mark_step = 0;
+  size_t pause_depth = 0;
+  bool young_collection_requested = false;
+  bool marking = false;
 };
 
 template <typename Heap, typename Hash_table, typename Value_stack,
           typename Call_frame_stack, typename Compiler>
 class GC : Memory_tracker {
  public:
-  GC(Heap& heap, const Hash_table& globals, const Value_stack& stack,
-     const Call_frame_stack& call_frames, const Compiler& compiler)
+  GC(Heap& heap, Hash_table& globals, Value_stack& stack,
+     Call_frame_stack& call_frames, Compiler& compiler,
+     const Gc_options& options = {})
   noexcept
-      : heap{&heap},
+      : Memory_tracker{options},
+        heap{&heap},
         globals{&globals},
         stack{&stack},
         call_frames{&call_frames},
-        compiler{&compiler} {}
+        compiler{&compiler},
+        concurrent{options.concurrent_marking},
+        compact{options.compact},
+        marker_threads{std::max<size_t>(options.marker_threads, 1)} {}
+
+  ~GC() noexcept override {
+    if (marker.joinable()) {
+      marker.join();
+    }
+  }
+
+  using Memory_tracker::collect_garbage;
+  using Memory_tracker::collect_if_requested;
+  using Memory_tracker::get_pauses;
+  using Memory_tracker::get_stats;
+  using Memory_tracker::is_collection_requested;
+
+  void begin_marking() noexcept override {
+    heap->finish_sweep();
+    heap->set_marking(true);
+    marked_bytes = 0;
+    marked_objects = {};
+    mark_roots();
+    if (concurrent) {
+      heap->set_concurrent_marking(true);
+      marker_done = false;
+      marker = std::thread{[this] { run_marker(); }};
+    }
+  }
+
+  // With a marker thread, only reports whether it has run out of work.
+  bool mark_step(Pause_recorder::Duration budget) noexcept override {
+    if (marker.joinable()) {
+      return marker_done.load(std::memory_order_acquire);
+    }
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+    do {
+      mark_batch_of_gray_objects();
+    } while (!gray_objects.empty() &&
+             std::chrono::steady_clock::now() < deadline);
+    return gray_objects.empty();
+  }
 
-  void collect_garbage() noexcept override {
+  // The roots are not guarded by write barriers, so they are marked again.
+  // Young survivors are promoted gray.
+  size_t finish_marking() noexcept override {
+    if (marker.joinable()) {
+      marker.join();
+      heap->set_concurrent_marking(false);
+    }
+    collect_young();
     mark_roots();
     trace_references();
-    heap->sweep();
+    heap->set_marking(false);
+    const auto freed = heap->sweep(marked_bytes);
+    if (compact) {
+      compact_heap();
+    }
+    stats.live_objects = marked_objects;
+    stats.interned_strings = heap->interned_string_count();
+    return freed;
+  }
+
+  // Promotes every young object reachable from the roots or from a remembered
+  // old holder, then discards the nursery.
+  void collect_young() noexcept override {
+    const auto guard = heap->guard_marker();
+    ++stats.young_collections;
+    const auto update = [this](auto reference) { return evacuate(reference); };
+    update_roots(update);
+    heap->for_each_remembered_object(
+        [&](Object* holder) { update_references(holder, update); });
+    heap->for_each_remembered_table(
+        [&](Hash_table& table) { update_table(table, update); });
+    while (!promoted_objects.empty()) {
+      auto object = promoted_objects.back();
+      promoted_objects.pop_back();
+      update_references(object, update);
+    }
+    heap->sweep_young();
   }
 
  private:
+  template <typename T>
+  T* evacuate(T* object) noexcept {
+    if (!object || !heap->is_young(object)) {
+      return object;
+    }
+    if (const auto copy = heap->forwarded(object); copy) {
+      return static_cast<T*>(copy);
+    }
+    const auto copy = heap->promote(object);
+    promoted_objects.push_back(copy);
+    if (is_marking()) {
+      mark_object(copy);
+    }
+    return static_cast<T*>(copy);
+  }
+
+  Value evacuate(Value value) noexcept {
+    return value.is_object() ? Value{evacuate(value.as_object())} : value;
+  }
+
+  // Moves the survivors of sparse pages together after a sweep, so that their
+  // pages can be given back, and points every reference at the new copies.
+  void compact_heap() noexcept {
+    if (heap->evacuate_sparse_pages() > 0) {
+      const auto update = [](auto reference) { return relocated(reference); };
+      update_roots(update);
+      update_table(*globals, update);
+      heap->update_interned_strings(update);
+      heap->for_each_old_object(
+          [&](Object* object) { update_references(object, update); });
+    }
+    heap->release_evacuated_pages();
+  }
+
+  template <typename T>
+  static T* relocated(T* object) noexcept {
+    if (object) {
+      if (const auto copy = Heap::forwarded(object); copy) {
+        return static_cast<T*>(copy);
+      }
+    }
+    return object;
+  }
+
+  static Value relocated(Value value) noexcept {
+    return value.is_object() ? Value{relocated(value.as_object())} : value;
+  }
+
+  template <typename Update>
+  void update_roots(const Update& update) noexcept {
+    for (size_t i = 0; i < stack->size(); ++i) {
+      (*stack)[i] = update((*stack)[i]);
+    }
+    for (size_t i = 0; i < call_frames->size(); ++i) {
+      auto& frame = (*call_frames)[i];
+      frame.closure = update(frame.closure);
+    }
+    heap->get_open_upvalues().for_each_link(
+        [&](Upvalue*& upvalue) { upvalue = update(upvalue); });
+    if (compiler) {
+      compiler->for_each_func([&](Function*& func) { func = update(func); });
+    }
+  }
+
+  template <typename Update>
+  static void update_table(Hash_table& table, const Update& update) noexcept {
+    table.for_each([&](String*& key, Value& value) {
+      key = update(key);
+      value = update(value);
+    });
+  }
+
+  template <typename Update>
+  static void update_references(Object* object, const Update& update) noexcept {
+    if (object->is<Closure>()) {
+      auto closure = object->as<Closure>();
+      closure->set_func(update(closure->get_func()));
+      const auto upvalues = closure->get_upvalues();
+      for (size_t i = 0; i < closure->get_upvalue_count(); ++i) {
+        upvalues[i] = update(upvalues[i]);
+      }
+    } else if (object->is<Function>()) {
+      auto func = object->as<Function>();
+      func->name = update(func->name);
+      func->closure = update(func->closure);
+      for (auto& constant : func->get_chunk().get_constants()) {
+        constant = update(constant);
+      }
+    } else if (object->is<Upvalue>()) {
+      auto upvalue = object->as<Upvalue>();
+      upvalue->closed = update(upvalue->closed);
+    } else if (object->is<Rope>()) {
+      auto rope = object->as<Rope>();
+      rope->left = update(rope->left);
+      rope->right = update(rope->right);
+      rope->flat = update(rope->flat);
+    }
+  }
+
   void mark_roots() noexcept {
     for (size_t i = 0; i < stack->size(); ++i) {
       mark_value((*stack)[i]);
@@ -86,9 +474,11 @@ class GC : Memory_tracker {
     }
   }
 
+  // Young objects are never marked: the ones that survive are promoted gray.
   void mark_object(Object* object) noexcept {
-    if (object && !object->is_marked) {
-      object->is_marked = true;
+    if (object && !heap->is_young(object) && heap->mark(object)) {
+      marked_bytes += object->size();
+      ++marked_objects[object->get_id()];
       gray_objects.push_back(object);
     }
   }
@@ -100,39 +490,174 @@ class GC : Memory_tracker {
     });
   }
 
+  void mark_batch_of_gray_objects() noexcept {
+    heap->drain_shaded([&](Object* object) { mark_object(object); });
+    for (size_t i = 0; i < mark_batch && !gray_objects.empty(); ++i) {
+      auto object = gray_objects.back();
+      gray_objects.pop_back();
+      blacken_object(object);
+    }
+  }
+
+  // Runs on the marker thread. The mutator takes the same lock for stores
+  // into old objects and for young collections, which also mark.
+  void run_marker() noexcept {
+    while (true) {
+      const auto guard = heap->guard_marker();
+      mark_batch_of_gray_objects();
+      if (gray_objects.empty()) {
+        marker_done.store(true, std::memory_order_release);
+        return;
+      }
+    }
+  }
+
+  // Small graphs are marked on this thread. Once the gray stack outlasts
+  // serial_mark_limit objects, the rest is shared among the marker threads.
   void trace_references() noexcept {
-    while (!gray_objects.empty()) {
+    heap->drain_shaded([&](Object* object) { mark_object(object); });
+    for (size_t i = 0; !gray_objects.empty(); ++i) {
+      if (i == serial_mark_limit && marker_threads > 1) {
+        trace_in_parallel();
+        return;
+      }
       auto object = gray_objects.back();
       gray_objects.pop_back();
       blacken_object(object);
     }
   }
 
-  void blacken_object(Object* object) noexcept {
+  // Every thread owns a deque of gray objects and steals from the others when
+  // it runs dry. Marking ends once all threads are idle at the same time:
+  // only threads that are not idle own gray objects and make new ones.
+  void trace_in_parallel() noexcept {
+    std::vector<std::unique_ptr<Work_stealing_deque<Object>>> deques;
+    for (size_t i = 0; i < marker_threads; ++i) {
+      deques.push_back(std::make_unique<Work_stealing_deque<Object>>());
+    }
+    for (auto object : gray_objects) {
+      deques.front()->push(object);
+    }
+    gray_objects.clear();
+
+    std::vector<size_t> bytes(marker_threads);
+    std::vector<Object_counts> objects(marker_threads);
+    std::atomic<size_t> idle{0};
+    const auto work = [&](size_t self) noexcept {
+      auto& deque = *deques[self];
+      size_t marked = 0;
+      Object_counts counts{};
+      const auto mark = [&](Object* object) {
+        if (object && !heap->is_young(object) && heap->mark_atomic(object)) {
+          marked += object->size();
+          ++counts[object->get_id()];
+          deque.push(object);
+        }
+      };
+      while (true) {
+        while (const auto object = deque.pop()) {
+          for_each_reference(object, mark);
+        }
+        Object* stolen = nullptr;
+        for (size_t i = 1; i < marker_threads && !stolen; ++i) {
+          stolen = deques[(self + i) % marker_threads]->steal();
+        }
+        if (stolen) {
+          for_each_reference(stolen, mark);
+          continue;
+        }
+        idle.fetch_add(1);
+        while (idle.load() < marker_threads) {
+          if (std::any_of(deques.cbegin(), deques.cend(),
+                          [](const auto& other) { return !other->empty(); })) {
+            idle.fetch_sub(1);
+            break;
+          }
+          std::this_thread::yield();
+        }
+        if (idle.load() == marker_threads) {
+          bytes[self] = marked;
+          objects[self] = counts;
+          return;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < marker_threads; ++i) {
+      threads.emplace_back(work, i);
+    }
+    work(0);
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (auto marked : bytes) {
+      marked_bytes += marked;
+    }
+    for (const auto& counts : objects) {
+      for (size_t i = 0; i < counts.size(); ++i) {
+        marked_objects[i] += counts[i];
+      }
+    }
+  }
+
+  template <typename Mark>
+  static void for_each_reference(Object* object, Mark&& mark) noexcept {
     if (object->is<Closure>()) {
       auto closure = object->as<Closure>();
-      mark_object(closure->get_func());
-      for (auto upvalue : closure->get_upvalues()) {
-        mark_object(upvalue);
+      mark(closure->get_func());
+      const auto upvalues = closure->get_upvalues();
+      for (size_t i = 0; i < closure->get_upvalue_count(); ++i) {
+        if (upvalues[i].is_object()) {
+          mark(upvalues[i].as_object());
+        }
       }
     } else if (object->is<Function>()) {
       auto func = object->as<Function>();
-      mark_object(func->name);
+      mark(func->name);
+      mark(func->closure);
 
       for (auto constant : func->get_chunk().get_constants()) {
-        mark_value(constant);
+        if (constant.is_object()) {
+          mark(constant.as_object());
+        }
       }
     } else if (object->is<Upvalue>()) {
-      mark_value(object->as<Upvalue>()->closed);
+      if (auto closed = object->as<Upvalue>()->closed;
+          closed.is_object()) {
+        mark(closed.as_object());
+      }
+    } else if (object->is<Rope>()) {
+      auto rope = object->as<Rope>();
+      mark(rope->left);
+      mark(rope->right);
+      mark(rope->flat);
     }
   }
 
+  void blacken_object(Object* object) noexcept {
+    for_each_reference(object, [&](Object* child) { mark_object(child); });
+  }
+
+  using Object_counts = std::array<size_t, Object::Types::size>;
+
+  // Gray objects blackened between two looks at the clock.
+  static constexpr size_t mark_batch = 64;
+  static constexpr size_t serial_mark_limit = 4096;
+
   Heap* heap;
-  const Hash_table* globals;
-  const Value_stack* stack;
-  const Call_frame_stack* call_frames;
-  const Compiler* compiler;
+  Hash_table* globals;
+  Value_stack* stack;
+  Call_frame_stack* call_frames;
+  Compiler* compiler;
   std::vector<Object*> gray_objects;
+  std::vector<Object*> promoted_objects;
+  size_t marked_bytes = 0;
+  Object_counts marked_objects{};
+  bool concurrent;
+  bool compact;
+  size_t marker_threads;
+  std::thread marker;
+  std::atomic<bool> marker_done{false};
 };
 
 }  // namespace lox
@@ -0,0 +1,131 @@
+#ifndef LOX_HASH_H
+#define LOX_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace lox {
+
+namespace hash {
+
+// 32-bit FNV-1a, one byte at a time. Short and simple, but every byte costs a
+// multiplication that depends on the previous one.
+struct Fnv1a {
+  uint32_t operator()(std::string_view string) const noexcept {
+    uint32_t hash = 2166136261u;
+    for (const auto ch : string) {
+      hash ^= static_cast<unsigned char>(ch);
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+};
+
+// wyhash (final version 4, by Wang Yi), folded to 32 bits. Reads eight bytes
+// at a time and mixes with a 64 by 64 bit multiplication; strings up to 16
+// bytes take a single mix whatever their length.
+struct Wyhash {
+  uint32_t operator()(std::string_view string) const noexcept {
+    const auto p = reinterpret_cast<const unsigned char*>(string.data());
+    const auto length = string.size();
+    uint64_t seed = mix(secret[0], secret[1]);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (length <= 16) {
+      if (length >= 4) {
+        const auto middle = (length >> 3) << 2;
+        a = (read4(p) << 32) | read4(p + middle);
+        b = (read4(p + length - 4) << 32) | read4(p + length - 4 - middle);
+      } else if (length > 0) {
+        a = (uint64_t{p[0]} << 16) | (uint64_t{p[length >> 1]} << 8) |
+            p[length - 1];
+      }
+    } else {
+      auto q = p;
+      auto rest = length;
+      if (rest > 48) {
+        auto seed1 = seed;
+        auto seed2 = seed;
+        do {
+          seed = mix(read8(q) ^ secret[1], read8(q + 8) ^ seed);
+          seed1 = mix(read8(q + 16) ^ secret[2], read8(q + 24) ^ seed1);
+          seed2 = mix(read8(q + 32) ^ secret[3], read8(q + 40) ^ seed2);
+          q += 48;
+          rest -= 48;
+        } while (rest > 48);
+        seed ^= seed1 ^ seed2;
+      }
+      while (rest > 16) {
+        seed = mix(read8(q) ^ secret[1], read8(q + 8) ^ seed);
+        q += 16;
+        rest -= 16;
+      }
+      a = read8(q + rest - 16);
+      b = read8(q + rest - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    multiply(a, b);
+    const auto hash = mix(a ^ secret[0] ^ length, b ^ secret[1]);
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+  }
+
+ private:
+  static constexpr uint64_t secret[] = {
+      0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+      0x4d5a2da51de1aa47ull};
+
+  // Replaces a and b by the low and high halves of their product.
+  static void multiply(uint64_t& a, uint64_t& b) noexcept {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 Uint128;
+    const auto product = Uint128{a} * b;
+    a = static_cast<uint64_t>(product);
+    b = static_cast<uint64_t>(product >> 64);
+#else
+    const auto a_high = a >> 32;
+    const auto a_low = a & 0xffffffffu;
+    const auto b_high = b >> 32;
+    const auto b_low = b & 0xffffffffu;
+    const auto high = a_high * b_high;
+    const auto middle0 = a_high * b_low;
+    const auto middle1 = b_high * a_low;
+    const auto low = a_low * b_low;
+    const auto t = low + (middle0 << 32);
+    const uint64_t carry = t < low;
+    const auto product_low = t + (middle1 << 32);
+    const auto product_high = high + (middle0 >> 32) + (middle1 >> 32) +
+                              carry + (product_low < t);
+    a = product_low;
+    b = product_high;
+#endif
+  }
+
+  static uint64_t mix(uint64_t a, uint64_t b) noexcept {
+    multiply(a, b);
+    return a ^ b;
+  }
+
+  static uint64_t read8(const unsigned char* p) noexcept {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  static uint64_t read4(const unsigned char* p) noexcept {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+};
+
+}  // namespace hash
+
+// The hash of every string, and so of every key in a Hash_table. Stored in
+// the strings, so it is never computed twice for one string.
+using String_hash = hash::Wyhash;
+
+}  // namespace lox
+
+#endif
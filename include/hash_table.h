@@ -1,6 +1,17 @@
 #ifndef LOX_HASH_TABLE_H
 #define LOX_HASH_TABLE_H
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "contract.h"
 #include "gc.h"
 #include "object.h"
@@ -8,9 +19,41 @@
 
 namespace lox {
 
+struct Hash_table_stats {
+  // Totals over the lifetime of the table: rebuilds at a larger, the same or
+  // a smaller capacity.
+  size_t growths = 0;
+  size_t rehashes = 0;
+  size_t shrinks = 0;
+  // Measured when the statistics are asked for.
+  size_t capacity = 0;
+  double load = 0;
+  double deleted_ratio = 0;
+  double mean_probe = 0;
+  size_t max_probe = 0;
+
+  // Visits every statistic as a name and a number.
+  template <typename Visitor>
+  void for_each(Visitor&& visitor) const noexcept {
+    visitor("growths", growths);
+    visitor("rehashes", rehashes);
+    visitor("shrinks", shrinks);
+    visitor("capacity", capacity);
+    visitor("load", load);
+    visitor("deleted_ratio", deleted_ratio);
+    visitor("mean_probe", mean_probe);
+    visitor("max_probe", max_probe);
+  }
+};
+
+// Open addressing in the style of Swiss tables: besides its slots the table
+// keeps one control byte per slot, either empty, deleted or the low seven bits
+// of the key's hash. The rest of the hash picks a group of sixteen slots to
+// start from, and a probe compares the control bytes of a whole group at once,
+// so keys are only looked at when their seven bits match.
 struct Hash_table {
  public:
-  Hash_table() noexcept : entries{nullptr}, capacity_mask{-1}, count{0} {}
+  Hash_table() noexcept = default;
   ~Hash_table() noexcept { free_current_entries(); }
 
   Hash_table(const Hash_table&) noexcept = delete;
@@ -19,151 +62,363 @@ struct Hash_table {
   Hash_table& operator=(Hash_table&&) noexcept = delete;
 
   bool contains(const String* key) const noexcept {
-    const auto& dest = find_entry(entries, capacity_mask, key);
-    return dest.key != nullptr;
+    return find_index(key) != npos;
   }
 
   void insert(String* key, Value value) noexcept {
-    adjust_capacity();
-    auto& dest = find_entry(entries, capacity_mask, key);
-    if (dest.key == nullptr && dest.value.is_nil()) {
-      ++count;
+    if (const auto index = find_index(key); index != npos) {
+      entries[index].value = value;
+      return;
+    }
+    if (growth_left == 0) {
+      adjust_capacity();
     }
-    dest.key = key;
-    dest.value = value;
+    const auto index = find_free_index(key->get_hash());
+    growth_left -= controls[index] == empty;
+    controls[index] = fragment_of(key->get_hash());
+    entries[index] = Entry{key, value};
+    ++count;
   }
 
   bool set(const String* key, Value value) noexcept {
-    if (auto& dest = find_entry(entries, capacity_mask, key); dest.key) {
-      dest.value = value;
+    if (const auto index = find_index(key); index != npos) {
+      entries[index].value = value;
       return true;
     }
     return false;
   }
 
   Value* get_if(const String* key) const noexcept {
-    auto& dest = find_entry(entries, capacity_mask, key);
-    return dest.key ? &dest.value : nullptr;
+    const auto index = find_index(key);
+    return index != npos ? &entries[index].value : nullptr;
   }
 
   bool erase(const String* key) noexcept {
-    if (count == 0) {
-      return false;
-    }
-    if (auto& dest = find_entry(entries, capacity_mask, key); dest.key) {
-      dest.key = nullptr;
+    if (const auto index = find_index(key); index != npos) {
+      erase_at(index);
       return true;
     }
     return false;
   }
 
-  String* find_string(const std::string& string) noexcept {
-    if (count == 0) {
-      return nullptr;
-    }
-    int index = String::hash_from(string) & capacity_mask;
-    while (true) {
-      if (auto& current = entries[index];
-          current.key && *current.key == string) {
-        return current.key;
-      } else if (current.value.is_nil()) {
-        return nullptr;
+  String* find_string(std::string_view string, uint32_t hash) const noexcept {
+    const auto index = probe(hash, [&](size_t index) {
+      return entries[index].key->equals(string, hash);
+    });
+    return index != npos ? entries[index].key : nullptr;
+  }
+
+  template <typename Visitor>
+  void for_each(Visitor&& visitor) const noexcept {
+    for (size_t i = 0; i < capacity; ++i) {
+      if (is_full(controls[i])) {
+        visitor(entries[i].key, entries[i].value);
       }
-      index = (index + 1) & capacity_mask;
     }
   }
 
+  // Lets the visitor update keys and values in place. A key may only be
+  // replaced by a string with the same hash.
   template <typename Visitor>
-  void for_each(Visitor&& visitor) const noexcept {
-    for (auto i = 0; i <= capacity_mask; ++i) {
-      if (entries[i].key) {
+  void for_each(Visitor&& visitor) noexcept {
+    for (size_t i = 0; i < capacity; ++i) {
+      if (is_full(controls[i])) {
         visitor(entries[i].key, entries[i].value);
       }
     }
   }
 
+  // Points the entry of a key that moved to its new address. The old address
+  // is only compared, never read.
+  void rekey(const String* from, String* to) noexcept {
+    const auto index = probe(to->get_hash(), [&](size_t index) {
+      return entries[index].key == from;
+    });
+    ENSURES(index != npos);
+    entries[index].key = to;
+  }
+
   template <typename Pred>
   void erase_if(Pred&& pred) noexcept {
-    for (auto i = 0; i <= capacity_mask; ++i) {
-      if (auto& dest = entries[i]; dest.key && pred(dest.key, dest.value)) {
-        dest.key = nullptr;
-        dest.value = true;
+    for (size_t i = 0; i < capacity; ++i) {
+      if (is_full(controls[i]) && pred(entries[i].key, entries[i].value)) {
+        erase_at(i);
+      }
+    }
+  }
+
+  size_t size() const noexcept { return count; }
+  size_t get_capacity() const noexcept { return capacity; }
+  size_t deleted_slots() const noexcept {
+    return capacity ? max_load_of(capacity) - count - growth_left : 0;
+  }
+
+  // Rebuilds the table without its deleted slots once they take a quarter of
+  // it, and at a smaller capacity once the entries fill less than an eighth
+  // of it; an empty table lets go of its slots. Returns true if it did so.
+  bool compact() noexcept {
+    if (capacity == 0) {
+      return false;
+    }
+    const auto sparse = count < capacity / 8 && capacity > initial_capacity;
+    if (count > 0 && !sparse && deleted_slots() <= capacity / 4) {
+      return false;
+    }
+    rebuild(count == 0 ? 0 : capacity_for(count));
+    return true;
+  }
+
+  // The groups a lookup of each entry visits, on average and at most.
+  struct Probe_lengths {
+    double mean = 0;
+    size_t max = 0;
+  };
+  Probe_lengths probe_lengths() const noexcept {
+    Probe_lengths lengths;
+    if (count == 0) {
+      return lengths;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < capacity; ++i) {
+      if (is_full(controls[i])) {
+        const auto length = groups_to(entries[i].key->get_hash(), i);
+        total += length;
+        lengths.max = std::max(lengths.max, length);
       }
     }
+    lengths.mean = static_cast<double>(total) / static_cast<double>(count);
+    return lengths;
+  }
+
+  // Walks the whole table for the probe lengths, so it is meant for
+  // benchmarks and tests rather than for every operation.
+  Hash_table_stats get_stats() const noexcept {
+    auto result = stats;
+    result.capacity = capacity;
+    if (capacity > 0) {
+      result.load = static_cast<double>(count) / static_cast<double>(capacity);
+      result.deleted_ratio = static_cast<double>(deleted_slots()) /
+                             static_cast<double>(capacity);
+    }
+    const auto lengths = probe_lengths();
+    result.mean_probe = lengths.mean;
+    result.max_probe = lengths.max;
+    return result;
   }
 
  private:
   struct Entry {
-    String* key = nullptr;
+    String* key;
     Value value;
   };
 
-  constexpr static int capacity_of(int capacity_mask) noexcept {
-    return capacity_mask + 1;
+  using Control = int8_t;
+  static constexpr Control empty = -128;
+  static constexpr Control deleted = -2;
+  static constexpr size_t group_width = 16;
+  static constexpr size_t npos = SIZE_MAX;
+  static constexpr size_t initial_capacity = group_width;
+
+  static bool is_full(Control control) noexcept { return control >= 0; }
+  static Control fragment_of(uint32_t hash) noexcept {
+    return static_cast<Control>(hash & 0x7f);
+  }
+
+  // Bit i is set for each slot i of the group whose control byte is wanted.
+  static uint32_t match(const Control* group, Control wanted) noexcept {
+#ifdef __SSE2__
+    const auto controls =
+        _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8(wanted))));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < group_width; ++i) {
+      mask |= static_cast<uint32_t>(group[i] == wanted) << i;
+    }
+    return mask;
+#endif
   }
-  constexpr static int capacity_mask_of(int capacity) noexcept {
-    return capacity - 1;
+
+  // Bit i is set for each slot i of the group that is empty or deleted.
+  static uint32_t match_free(const Control* group) noexcept {
+#ifdef __SSE2__
+    return static_cast<uint32_t>(_mm_movemask_epi8(
+        _mm_load_si128(reinterpret_cast<const __m128i*>(group))));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < group_width; ++i) {
+      mask |= static_cast<uint32_t>(!is_full(group[i])) << i;
+    }
+    return mask;
+#endif
+  }
+
+  static size_t lowest_bit(uint32_t mask) noexcept {
+    return static_cast<size_t>(__builtin_ctz(mask));
   }
 
-  Entry& find_entry(Entry* entries, int capacity_mask, const String* key) const
-      noexcept {
-    int index = key->get_hash() & capacity_mask;
-    Entry* tobmstone = nullptr;
-    while (true) {
-      if (auto& current = entries[index]; !current.key) {
-        if (current.value.is_nil()) {
-          return tobmstone ? *tobmstone : current;
-        } else if (!tobmstone) {
-          tobmstone = &current;
+  // Visits the groups from the one the hash picks, stepping one group further
+  // each time, which reaches every group of a power-of-two count. Stops at a
+  // slot whose fragment matches and that the predicate accepts, or at a group
+  // with an empty slot, since the key would have been put there.
+  template <typename Pred>
+  size_t probe(uint32_t hash, Pred&& pred) const noexcept {
+    if (count == 0) {
+      return npos;
+    }
+    const auto fragment = fragment_of(hash);
+    const auto group_mask = capacity / group_width - 1;
+    auto group = (hash >> 7) & group_mask;
+    for (size_t step = 1;; ++step) {
+      const auto controls_of_group = controls + group * group_width;
+      for (auto mask = match(controls_of_group, fragment); mask;
+           mask &= mask - 1) {
+        if (const auto index = group * group_width + lowest_bit(mask);
+            pred(index)) {
+          return index;
         }
-      } else if (current.key == key) {
-        return current;
       }
-      index = (index + 1) & capacity_mask;
+      if (match(controls_of_group, empty)) {
+        return npos;
+      }
+      ENSURES(step <= group_mask + 1);
+      group = (group + step) & group_mask;
+    }
+  }
+
+  // The number of groups a probe for the hash visits to reach the slot.
+  size_t groups_to(uint32_t hash, size_t index) const noexcept {
+    const auto group_mask = capacity / group_width - 1;
+    auto group = (hash >> 7) & group_mask;
+    size_t step = 1;
+    for (; group != index / group_width; ++step) {
+      group = (group + step) & group_mask;
     }
+    return step;
+  }
+
+  size_t find_index(const String* key) const noexcept {
+    return probe(key->get_hash(),
+                 [&](size_t index) { return entries[index].key == key; });
+  }
+
+  // The first empty or deleted slot on the key's probe sequence.
+  size_t find_free_index(uint32_t hash) const noexcept {
+    const auto group_mask = capacity / group_width - 1;
+    auto group = (hash >> 7) & group_mask;
+    for (size_t step = 1;; ++step) {
+      if (const auto mask = match_free(controls + group * group_width); mask) {
+        return group * group_width + lowest_bit(mask);
+      }
+      ENSURES(step <= group_mask + 1);
+      group = (group + step) & group_mask;
+    }
+  }
+
+  // No probe went on past a group that still has an empty slot, so a slot in
+  // such a group can become empty again; otherwise it is marked deleted.
+  void erase_at(size_t index) noexcept {
+    const auto group = controls + index / group_width * group_width;
+    if (match(group, empty)) {
+      controls[index] = empty;
+      ++growth_left;
+    } else {
+      controls[index] = deleted;
+    }
+    --count;
+  }
+
+  // At most seven slots in eight are used, and the deleted ones count as used
+  // until the table is rebuilt. Rebuilding at the same capacity is enough when
+  // deleted slots took the room.
+  static size_t max_load_of(size_t capacity) noexcept {
+    return capacity - capacity / 8;
   }
 
   void adjust_capacity() noexcept {
-    constexpr auto max_load = 0.75;
-    if (count + 1 > capacity_of(capacity_mask) * max_load) {
-      constexpr int initial_capacity = 8;
-      const auto capacity = capacity_of(capacity_mask);
-      const auto new_capacity_mask = capacity_mask_of(
-          capacity < initial_capacity ? initial_capacity : capacity * 2);
-      auto new_entries = allocate_new_entries(capacity_of(new_capacity_mask));
-      count = 0;
-      for (int index = 0; index <= capacity_mask; ++index) {
-        if (const auto& current = entries[index]; current.key) {
-          auto& dest = find_entry(new_entries, new_capacity_mask, current.key);
-          dest = current;
-          ++count;
-        }
+    rebuild(capacity == 0 ? initial_capacity
+                          : (count + 1 > max_load_of(capacity) / 2
+                                 ? capacity * 2
+                                 : capacity));
+  }
+
+  // The smallest capacity that holds the entries at no more than half load,
+  // so that the table does not grow again right away.
+  static size_t capacity_for(size_t count) noexcept {
+    auto capacity = initial_capacity;
+    while (count > max_load_of(capacity) / 2) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  void rebuild(size_t new_capacity) noexcept {
+    const auto old_controls = controls;
+    const auto old_entries = entries;
+    const auto old_capacity = capacity;
+    if (new_capacity > old_capacity) {
+      ++stats.growths;
+    } else if (new_capacity == old_capacity) {
+      ++stats.rehashes;
+    } else {
+      ++stats.shrinks;
+    }
+    if (new_capacity == 0) {
+      controls = nullptr;
+      entries = nullptr;
+      capacity = 0;
+      growth_left = 0;
+    } else {
+      allocate_new_entries(new_capacity);
+    }
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (is_full(old_controls[i])) {
+        const auto hash = old_entries[i].key->get_hash();
+        const auto index = find_free_index(hash);
+        controls[index] = fragment_of(hash);
+        entries[index] = old_entries[i];
       }
-      free_current_entries();
-      entries = new_entries;
-      capacity_mask = new_capacity_mask;
     }
+    free_entries(old_entries, old_capacity);
+  }
+
+  static size_t bytes_of(size_t capacity) noexcept {
+    return capacity * (sizeof(Entry) + sizeof(Control));
   }
 
-  Entry* allocate_new_entries(size_t count) const noexcept {
+  // The slots and then the control bytes, in one block aligned for a group.
+  void allocate_new_entries(size_t new_capacity) noexcept {
+    static_assert(sizeof(Entry) % group_width == 0);
     if (auto tracker = Memory_tracker::current(); tracker) {
-      tracker->allocate(sizeof(Entry) * count);
+      tracker->allocate(bytes_of(new_capacity));
     }
-    return new Entry[count];
+    const auto block = static_cast<std::byte*>(operator new(
+        bytes_of(new_capacity), std::align_val_t{group_width}));
+    entries = new (block) Entry[new_capacity];
+    controls = reinterpret_cast<Control*>(block + new_capacity * sizeof(Entry));
+    std::memset(controls, empty, new_capacity);
+    capacity = new_capacity;
+    growth_left = max_load_of(new_capacity) - count;
   }
 
-  void free_current_entries() noexcept {
+  static void free_entries(Entry* entries, size_t capacity) noexcept {
     if (entries) {
       if (auto tracker = Memory_tracker::current(); tracker) {
-        tracker->free(sizeof(Entry) * capacity_of(capacity_mask));
+        tracker->free(bytes_of(capacity));
       }
-      delete[] entries;
+      operator delete(entries, std::align_val_t{group_width});
     }
   }
 
-  Entry* entries;
-  int capacity_mask;
-  int count;
+  void free_current_entries() noexcept { free_entries(entries, capacity); }
+
+  Control* controls = nullptr;
+  Entry* entries = nullptr;
+  size_t capacity = 0;
+  size_t count = 0;
+  size_t growth_left = 0;
+  Hash_table_stats stats;
 };
 
 }  // namespace lox
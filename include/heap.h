@@ -1,8 +1,16 @@
 #ifndef LOX_HEAP_H
 #define LOX_HEAP_H
 
-#include <string>
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "allocator.h"
 #include "gc.h"
 #include "hash_table.h"
 #include "list.h"
@@ -13,28 +21,75 @@ namespace lox {
 
 class Heap {
  public:
-  using Object_list = List<Object>;
   using Upvalue_list = List<Upvalue, false>;
 
+  Heap() noexcept = default;
+
+  Heap(const Heap&) noexcept = delete;
+  Heap(Heap&&) noexcept = delete;
+  Heap& operator=(const Heap&) noexcept = delete;
+  Heap& operator=(Heap&&) noexcept = delete;
+
+  // The nursery is collected once its objects, with the memory they own, have
+  // grown to this size.
+  static constexpr size_t nursery_size = 1024 * 1024;
+
   template <typename T, typename... Args>
   T* make_object(Args&&... args) noexcept {
-    if (auto tracker = Memory_tracker::current(); tracker) {
-      tracker->allocate(sizeof(T));
+    static_assert(!std::is_same_v<T, Closure>, "Use make_closure().");
+    return emplace<T>(sizeof(T), std::forward<Args>(args)...);
+  }
+
+  // With room for the upvalues of the function, which the caller fills in.
+  Closure* make_closure(Function* func) noexcept {
+    return emplace<Closure>(Closure::size_for(func->get_upvalue_count()),
+                            func);
+  }
+
+  // Accounts for an object whose owned memory grew or shrank from old_size,
+  // as a function does when it is compiled lazily. The marker must not run.
+  void resized(const Object* object, size_t old_size) noexcept {
+    const auto size = object->size();
+    if (marking && is_marked(object)) {
+      // Its old size is already among the marked bytes.
+      marked_resize += static_cast<std::ptrdiff_t>(size) -
+                       static_cast<std::ptrdiff_t>(old_size);
+    }
+    if (is_young(object)) {
+      if (size > old_size) {
+        account_young(size - old_size);
+      }
+    } else if (size >= old_size) {
+      account_old(size - old_size);
+    } else {
+      ENSURES(old_size - size <= object_bytes);
+      if (auto tracker = Memory_tracker::current(); tracker) {
+        tracker->free(old_size - size);
+      }
+      object_bytes -= old_size - size;
     }
-    const auto obj = new T{std::forward<Args>(args)...};
-    objects.insert(obj);
-    return obj;
   }
 
-  String* make_string(std::string str) noexcept {
-    auto string = strings.find_string(str);
+  String* make_string(std::string_view str) noexcept {
+    const auto hash = String::hash_from(str);
+    auto string = strings.find_string(str, hash);
     if (!string) {
-      string = make_object<String>(std::move(str));
+      string = emplace<String>(String::size_for(str.size()), str, hash);
       strings.insert(string, true);
+      if (is_young(string)) {
+        young_strings.push_back(string);
+      }
+    } else if (marking) {
+      // The intern table does not keep strings alive, so a string that was
+      // unreachable when marking began may be handed out again here.
+      const auto guard = guard_marker();
+      shade(string);
     }
     return string;
   }
 
+  // Open upvalues are kept sorted from the top of the stack down, so the
+  // search stops at the first one at or below location.
   Upvalue* make_upvalue(Value* location) noexcept {
     Upvalue* previous = nullptr;
     auto it = open_upvalues.begin();
@@ -53,24 +108,260 @@ class Heap {
   const Upvalue_list& get_open_upvalues() const noexcept {
     return open_upvalues;
   }
+  Upvalue_list& get_open_upvalues() noexcept { return open_upvalues; }
 
-  void sweep() noexcept {
-    strings.erase_if(
-        [](const String* string, Value) { return !string->is_marked; });
+  static bool is_young(const Object* object) noexcept {
+    return Allocator::is_young(object);
+  }
 
-    objects.erase_if([](Object* object) {
-      if (object->is_marked) {
-        object->is_marked = false;
-        return false;
+  // Write barriers: stores into old holders are remembered when they may add
+  // a reference to a young object, so that a young collection does not need
+  // to scan the old generation. While marking, the overwritten value is
+  // shaded, so everything reachable when marking began gets marked (snapshot
+  // at the beginning). With a concurrent marker the barrier and the store
+  // must both happen under guard_marker().
+  void write_barrier(Object* holder, Value overwritten, Value value) noexcept {
+    shade(overwritten);
+    if (value.is_object() && is_young(value.as_object())) {
+      write_barrier(holder);
+    }
+  }
+  void write_barrier(Object* holder) noexcept {
+    if (!is_young(holder)) {
+      remember(holder);
+    }
+  }
+  void write_barrier(Hash_table& table, const String* key,
+                     Value value) noexcept {
+    if (is_young(key) || (value.is_object() && is_young(value.as_object()))) {
+      if (std::find(remembered_tables.cbegin(), remembered_tables.cend(),
+                    &table) == remembered_tables.cend()) {
+        remembered_tables.push_back(&table);
       }
-      return true;
+    }
+  }
+
+  template <typename Visitor>
+  void for_each_remembered_object(Visitor&& visitor) noexcept {
+    for (auto holder : remembered_objects) {
+      visitor(holder);
+    }
+  }
+  template <typename Visitor>
+  void for_each_remembered_table(Visitor&& visitor) noexcept {
+    for (auto table : remembered_tables) {
+      visitor(*table);
+    }
+  }
+
+  void set_marking(bool value) noexcept {
+    marking = value;
+    shaded_objects.clear();
+    if (marking) {
+      marked_resize = 0;
+    }
+  }
+  // While a marker thread runs, it reads old objects under the same mutex.
+  void set_concurrent_marking(bool value) noexcept { concurrent = value; }
+
+  // Keeps a concurrent marker away from the heap for as long as the returned
+  // lock lives. Without one, nothing is locked. Lazy compilation holds it
+  // while interning strings, hence the recursive mutex.
+  std::unique_lock<std::recursive_mutex> guard_marker() noexcept {
+    return concurrent ? std::unique_lock<std::recursive_mutex>{marker_mutex}
+                      : std::unique_lock<std::recursive_mutex>{};
+  }
+
+  void shade(Value value) noexcept {
+    if (marking && value.is_object() && !is_young(value.as_object())) {
+      shaded_objects.push_back(value.as_object());
+    }
+  }
+
+  template <typename Visitor>
+  void drain_shaded(Visitor&& visitor) noexcept {
+    for (auto object : shaded_objects) {
+      visitor(object);
+    }
+    shaded_objects.clear();
+  }
+
+  static Object* forwarded(Object* object) noexcept {
+    return static_cast<Object*>(Allocator::forwarded(object));
+  }
+
+  // Moves a young object into the old generation and leaves its new address
+  // behind.
+  Object* promote(Object* object) noexcept {
+    ENSURES(is_young(object) && !forwarded(object));
+    const auto copy = move_object(
+        object, [this](size_t size) { return allocator.allocate(size); });
+    account_old(copy->size());
+    return copy;
+  }
+
+  // Moves the live objects out of sparse old pages, finishing the sweep that
+  // sweep() began, and returns how many moved. References to them must be
+  // updated through forwarded() before release_evacuated_pages().
+  size_t evacuate_sparse_pages() noexcept {
+    allocator.begin_evacuation();
+    allocator.finish_sweep();
+    size_t moved = 0;
+    allocator.for_each_evacuee([&](void* cell) {
+      move_object(static_cast<Object*>(cell),
+                  [this](size_t size) { return allocator.allocate(size); });
+      ++moved;
     });
+    return moved;
+  }
+
+  void release_evacuated_pages() noexcept { allocator.release_evacuated(); }
+
+  template <typename Visitor>
+  void for_each_old_object(Visitor&& visitor) noexcept {
+    allocator.for_each_old_cell(
+        [&](void* cell) { visitor(static_cast<Object*>(cell)); });
+  }
+
+  size_t interned_string_count() const noexcept { return strings.size(); }
+  const Hash_table& get_interned_strings() const noexcept { return strings; }
+
+  // Lets the visitor replace interned strings with equal ones.
+  template <typename Visitor>
+  void update_interned_strings(Visitor&& visitor) noexcept {
+    strings.for_each([&](String*& key, Value&) { key = visitor(key); });
+  }
+
+  // Ends a young collection: every live young object has been promoted, so
+  // the others are destroyed and the nursery starts over.
+  void sweep_young() noexcept {
+    for (auto string : young_strings) {
+      if (const auto copy = forwarded(string); copy) {
+        strings.rekey(string, copy->as<String>());
+      } else {
+        strings.erase(string);
+      }
+    }
+    young_strings.clear();
+    strings.compact();
+    for (auto holder : remembered_objects) {
+      Allocator::forget(holder);
+    }
+    remembered_objects.clear();
+    remembered_tables.clear();
+    allocator.reset_nursery(nursery_size / Allocator::page_size);
+    young_bytes = 0;
+  }
+
+  static bool mark(Object* object) noexcept { return Allocator::mark(object); }
+  static bool mark_atomic(Object* object) noexcept {
+    return Allocator::mark_atomic(object);
   }
+  static bool is_marked(const Object* object) noexcept {
+    return Allocator::is_marked(object);
+  }
+
+  // Unmarked objects are destroyed lazily, as their cells are needed again.
+  // Returns the bytes of the objects that did not survive.
+  size_t sweep(size_t marked_bytes) noexcept {
+    marked_bytes += std::exchange(marked_resize, 0);
+    ENSURES(marked_bytes <= object_bytes);
+    strings.erase_if(
+        [](const String* string, Value) { return !is_marked(string); });
+    strings.compact();
+    allocator.begin_sweep();
+    return std::exchange(object_bytes, marked_bytes) - marked_bytes;
+  }
+
+  void finish_sweep() noexcept { allocator.finish_sweep(); }
+
+  const Allocator& get_allocator() const noexcept { return allocator; }
 
  private:
-  Object_list objects;
+  static void finalize(void* cell) noexcept {
+    static_cast<Object*>(cell)->destroy();
+  }
+
+  // Objects too large for the nursery are allocated old.
+  template <typename T, typename... Args>
+  T* emplace(size_t size, Args&&... args) noexcept {
+    if (size > Allocator::max_small_size) {
+      const auto object =
+          new (allocator.allocate(size)) T{std::forward<Args>(args)...};
+      account_old(object->size());
+      // Objects allocated old while marking are live in this cycle.
+      const auto guard = guard_marker();
+      shade(object);
+      return object;
+    }
+    const auto object =
+        new (allocator.allocate_young(size)) T{std::forward<Args>(args)...};
+    account_young(object->size() - size + Allocator::cell_size_of(size));
+    return object;
+  }
+
+  void account_old(size_t size) noexcept {
+    if (auto tracker = Memory_tracker::current(); tracker) {
+      tracker->allocate(size);
+    }
+    object_bytes += size;
+  }
+
+  void account_young(size_t size) noexcept {
+    young_bytes += size;
+    if (young_bytes > nursery_size) {
+      if (auto tracker = Memory_tracker::current(); tracker) {
+        tracker->request_young_collection();
+      }
+    }
+  }
+
+  void remember(Object* holder) noexcept {
+    if (Allocator::remember(holder)) {
+      remembered_objects.push_back(holder);
+    }
+  }
+
+  template <typename Allocate>
+  static Object* move_object(Object* object, Allocate&& allocate) noexcept {
+    return object->visit([&](auto& from) -> Object* {
+      return relocate(&from, allocate);
+    });
+  }
+
+  template <typename T>
+  static size_t allocation_size(const T&) noexcept {
+    return sizeof(T);
+  }
+  static size_t allocation_size(const String& string) noexcept {
+    return string.size();
+  }
+  static size_t allocation_size(const Closure& closure) noexcept {
+    return closure.size();
+  }
+
+  template <typename T, typename Allocate>
+  static T* relocate(T* object, Allocate&& allocate) noexcept {
+    const auto copy =
+        new (allocate(allocation_size(*object))) T{std::move(*object)};
+    object->~T();
+    Allocator::forward(object, copy);
+    return copy;
+  }
+
+  Allocator allocator{finalize};
   Hash_table strings;
   Upvalue_list open_upvalues;
+  size_t object_bytes = 0;
+  size_t young_bytes = 0;
+  std::ptrdiff_t marked_resize = 0;
+  std::vector<String*> young_strings;
+  std::vector<Object*> remembered_objects;
+  std::vector<Hash_table*> remembered_tables;
+  std::vector<Object*> shaded_objects;
+  std::recursive_mutex marker_mutex;
+  bool marking = false;
+  bool concurrent = false;
 };
 
 }  // namespace lox
@@ -0,0 +1,44 @@
+#ifndef LOX_IMAGE_H
+#define LOX_IMAGE_H
+
+#include <cstdint>
+#include <string>
+
+#include "heap.h"
+#include "object.h"
+
+namespace lox {
+
+// Versioned binary image of a compiled script: interned strings, then every
+// function in post order with its code, upvalue captures, line table and
+// constant pool. The script itself is the last function.
+namespace image {
+
+constexpr uint32_t version = 4;
+
+uint64_t hash_of(const std::string& source, bool stripped = false) noexcept;
+
+std::string save(const Function& script, uint64_t source_hash = 0) noexcept;
+
+Function* load(const char* data, size_t size, Heap& heap,
+               uint64_t source_hash = 0) noexcept;
+
+}  // namespace image
+
+class Compile_cache {
+ public:
+  explicit Compile_cache(std::string directory) noexcept
+      : directory{std::move(directory)} {}
+
+  Function* load(uint64_t source_hash, Heap& heap) const noexcept;
+  bool store(uint64_t source_hash, const Function& script) const noexcept;
+
+  std::string path_of(uint64_t source_hash) const noexcept;
+
+ private:
+  std::string directory;
+};
+
+}  // namespace lox
+
+#endif
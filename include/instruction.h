@@ -81,34 +81,6 @@ struct Jump_instr : Base {
   }
 };
 
-struct Closure_instr : Constant_instr {
-  struct Upvalue {
-    Upvalue(size_t index, bool is_local) noexcept
-        : index{static_cast<Bytecode>(index)},
-          is_local{static_cast<Bytecode>(is_local ? 1 : 0)} {
-      ENSURES(index <= UINT8_MAX);
-    }
-    Bytecode index;
-    Bytecode is_local;
-  };
-  using Upvalue_vector = std::vector<Upvalue>;
-
-  using Constant_instr::Constant_instr;
-
-  static constexpr size_t index_of_upvalues = 2;
-
-  static size_t add_upvalues(Bytecode_vector& code,
-                             const Upvalue_vector& upvalues) noexcept {
-    for (const auto& upvalue : upvalues) {
-      code.push_back(upvalue.is_local);
-      code.push_back(upvalue.index);
-    }
-    return upvalues.size() * 2;
-  }
-
-  const Bytecode* upvalues() const noexcept { return &code[index_of_upvalues]; }
-};
-
 // clang-format off
 #define INSTRUCTIONS(generator)               \
   generator(Constant, Constant_instr)         \
@@ -137,7 +109,7 @@ struct Closure_instr : Constant_instr {
   generator(Jump_if_false, Jump_instr)        \
   generator(Loop, Jump_instr)                 \
   generator(Call, Byte_instr)                 \
-  generator(Closure, Closure_instr)           \
+  generator(Closure, Constant_instr)          \
   generator(Close_upvalue, Simple_instr)      \
   generator(Return, Simple_instr)
 // clang-format on
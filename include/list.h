@@ -54,6 +54,17 @@ class List {
   Iterator begin() const noexcept { return head; }
   Iterator end() const noexcept { return nullptr; }
 
+  Node* front() const noexcept { return head; }
+
+  // Unlinks the first node and hands it to the caller without freeing it.
+  Node* pop_front() noexcept {
+    EXPECTS(head);
+    auto node = head;
+    head = node->next;
+    node->next = nullptr;
+    return node;
+  }
+
   void insert(Node* node, Node* after = nullptr) noexcept {
     ENSURES(node);
     if (after) {
@@ -65,8 +76,20 @@ class List {
     }
   }
 
+  template <typename Visitor>
+  void for_each_link(Visitor visitor) noexcept {
+    for (Node** link = &head; *link; link = &(*link)->next) {
+      visitor(*link);
+    }
+  }
+
   template <typename Pred>
   void erase_if(Pred pred) noexcept {
+    erase_if(pred, free_node);
+  }
+
+  template <typename Pred, typename Free>
+  void erase_if(Pred pred, Free free) noexcept {
     Node* previous = nullptr;
     Node* node = head;
     while (node != nullptr) {
@@ -78,7 +101,7 @@ class List {
         } else {
           head = node;
         }
-        free_node(erased);
+        free(erased);
       } else {
         previous = node;
         node = node->next;
@@ -20,10 +20,36 @@ inline Value clock(int, Value*) noexcept {
   return static_cast<double>(time) / one_second;
 }
 
+// Returns the collector statistic of the given name, as listed by
+// Gc_stats::for_each, or nil if there is none.
+inline Value gc_stats(int arg_count, Value* args) noexcept {
+  const auto tracker = Memory_tracker::current();
+  if (!tracker || arg_count != 1 || !args[0].is_object() ||
+      !args[0].as_object()->is<String>()) {
+    return Value{};
+  }
+  const auto& name = args[0].as_object()->as<String>()->get_string();
+  Value result;
+  tracker->get_stats().for_each([&](const char* stat, auto value) {
+    if (name == stat) {
+      result = static_cast<double>(value);
+    }
+  });
+  return result;
+}
+
 inline void register_natives(Hash_table& globals, Heap& heap) noexcept {
-  const auto name = heap.make_string("clock");
-  globals.insert(name, Value{});
-  globals.set(name, heap.make_object<Native_func>(clock));
+  // A name is not reachable until its insertion is done.
+  Memory_tracker::Pause_guard pause;
+  const auto define = [&](const char* native, Native_func::Func native_func) {
+    const auto name = heap.make_string(native);
+    globals.insert(name, Value{});
+    const auto func = heap.make_object<Native_func>(native_func);
+    globals.set(name, func);
+    heap.write_barrier(globals, name, func);
+  };
+  define("clock", clock);
+  define("gcStats", gc_stats);
 }
 
 }  // namespace lox
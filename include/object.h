@@ -1,35 +1,57 @@
 #ifndef LOX_OBJECT_H
 #define LOX_OBJECT_H
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "chunk.h"
 #include "contract.h"
 #include "exception.h"
+#include "hash.h"
+#include "scanner.h"
 #include "type_list.h"
 
 namespace lox {
 
+// Bytes of the buffer a string holds outside itself. Short strings are kept
+// inside the string object and own none.
+template <typename Text>
+size_t owned_bytes(const Text& text) noexcept {
+  const auto data = reinterpret_cast<const std::byte*>(text.data());
+  const auto self = reinterpret_cast<const std::byte*>(&text);
+  return data >= self && data < self + sizeof(Text) ? 0 : text.capacity() + 1;
+}
+
 class String;
+class Rope;
 class Function;
 class Native_func;
 class Upvalue;
 class Closure;
 
+// The header of every object is a single word holding its type id; mark bits
+// and size classes live in the pages of the allocator. Calls that depend on
+// the type are dispatched over Types, so objects carry no vtable.
 class Object {
  public:
-  using Types = Type_list<String, Function, Native_func, Upvalue, Closure>;
+  using Types =
+      Type_list<String, Rope, Function, Native_func, Upvalue, Closure>;
 
   template <typename T>
   constexpr static size_t id_of = Index_of<T, Types>::value;
 
-  explicit Object(size_t id) noexcept : id{id} { ENSURES(id < Types::size); }
-  virtual ~Object() noexcept = default;
+  explicit Object(size_t id) noexcept : id{static_cast<uint32_t>(id)} {
+    ENSURES(id < Types::size);
+  }
 
   Object(const Object&) noexcept = delete;
-  Object(Object&&) noexcept = delete;
   Object& operator=(const Object&) noexcept = delete;
   Object& operator=(Object&&) noexcept = delete;
 
@@ -38,6 +60,8 @@ class Object {
     return id == id_of<T>;
   }
 
+  size_t get_id() const noexcept { return id; }
+
   template <typename T>
   const T* as() const noexcept {
     ENSURES(is<T>());
@@ -49,45 +73,130 @@ class Object {
     return const_cast<T*>(std::as_const(*this).as<T>());
   }
 
-  virtual size_t size() const noexcept = 0;
-  virtual std::string to_string(bool = false) const noexcept = 0;
+  // Calls the visitor with the object as its own type.
+  template <typename Visitor>
+  decltype(auto) visit(Visitor&& visitor) noexcept;
+  template <typename Visitor>
+  decltype(auto) visit(Visitor&& visitor) const noexcept;
+
+  // Bytes of the object and of the memory it owns. The heap accounts for the
+  // size of old objects when they are promoted and when they change.
+  size_t size() const noexcept;
+  std::string to_string(bool verbose = false) const noexcept;
 
-  Object* next = nullptr;
-  bool is_marked = false;
+  // Runs the destructor of the object's own type.
+  void destroy() noexcept;
+
+ protected:
+  // Only used by the heap to move objects to other cells.
+  Object(Object&&) noexcept = default;
+  ~Object() noexcept = default;
 
  private:
-  size_t id;
+  uint32_t id;
 };
 
+// The characters of a string follow it in the same cell, so only the heap
+// creates strings, in cells of size_for(length) bytes.
 class String : public Object {
  public:
-  static uint32_t hash_from(const std::string& string) noexcept {
-    uint32_t hash = 2166136261u;
-    for (const auto ch : string) {
-      hash ^= ch;
-      hash *= 16777619;
-    }
-    return hash;
+  static uint32_t hash_from(std::string_view string) noexcept {
+    return String_hash{}(string);
   }
 
-  String(std::string str) noexcept
-      : Object{id_of<String>},
-        string{std::move(str)},
-        hash{hash_from(string)} {}
+  // With a terminating zero.
+  static constexpr size_t size_for(size_t length) noexcept {
+    return sizeof(String) + length + 1;
+  }
 
-  const std::string& get_string() const noexcept { return string; }
+  String(const String&) noexcept = delete;
+  String& operator=(const String&) noexcept = delete;
+
+  std::string_view get_string() const noexcept { return {chars(), length}; }
   uint32_t get_hash() const noexcept { return hash; }
 
-  size_t size() const noexcept override { return sizeof(String); };
-  std::string to_string(bool = false) const noexcept override { return string; }
+  bool equals(std::string_view string, uint32_t string_hash) const noexcept {
+    return hash == string_hash && get_string() == string;
+  }
 
-  friend bool operator==(const String& lhs, const String& rhs) noexcept {
-    return lhs.hash == rhs.hash && lhs.string == rhs.string;
+  size_t size() const noexcept { return size_for(length); };
+  std::string to_string(bool = false) const noexcept {
+    return std::string{get_string()};
   }
 
  private:
-  std::string string;
+  friend class Heap;
+
+  String(std::string_view string, uint32_t hash) noexcept
+      : Object{id_of<String>},
+        hash{hash},
+        length{static_cast<uint32_t>(string.size())} {
+    std::memcpy(chars(), string.data(), length);
+    chars()[length] = '\0';
+  }
+
+  String(String&& other) noexcept
+      : Object{std::move(other)}, hash{other.hash}, length{other.length} {
+    std::memcpy(chars(), other.chars(), length + 1);
+  }
+
+  const char* chars() const noexcept {
+    return reinterpret_cast<const char*>(this + 1);
+  }
+  char* chars() noexcept { return reinterpret_cast<char*>(this + 1); }
+
   uint32_t hash;
+  uint32_t length;
+};
+
+// The concatenation of two strings, each a String or a Rope, whose characters
+// are copied only once it is flattened: then it keeps the interned String and
+// lets go of its two halves. Building a string piece by piece is thus linear.
+class Rope : public Object {
+ public:
+  Rope(Object* left, Object* right, size_t length) noexcept
+      : Object{id_of<Rope>}, left{left}, right{right}, length{length} {
+    ENSURES(is_text(left) && is_text(right));
+  }
+
+  static bool is_text(const Object* object) noexcept {
+    return object->is<String>() || object->is<Rope>();
+  }
+  static size_t length_of(const Object* object) noexcept {
+    ENSURES(is_text(object));
+    return object->is<String>() ? object->as<String>()->get_string().size()
+                                : object->as<Rope>()->length;
+  }
+
+  size_t get_length() const noexcept { return length; }
+
+  void set_flat(String* string) noexcept {
+    ENSURES(!flat && string);
+    flat = string;
+    left = nullptr;
+    right = nullptr;
+  }
+
+  // Calls the visitor with the characters of each leaf from left to right.
+  // Ropes built in a loop are deep, so the walk keeps its own stack.
+  template <typename Visitor>
+  void for_each_piece(Visitor&& visitor) const noexcept;
+
+  size_t size() const noexcept { return sizeof(Rope); };
+  std::string to_string(bool = false) const noexcept {
+    std::string text;
+    text.reserve(length);
+    for_each_piece([&](std::string_view piece) { text.append(piece); });
+    return text;
+  }
+
+  Object* left;
+  Object* right;
+  // Null until the rope is flattened, and then its only reference.
+  String* flat = nullptr;
+
+ private:
+  size_t length;
 };
 
 class Function : public Object {
@@ -98,21 +207,62 @@ class Function : public Object {
   Chunk& get_chunk() noexcept { return chunk; }
 
   size_t get_arity() const noexcept { return arity; }
-  void inc_arity() noexcept { ++arity; }
+  void set_arity(size_t value) noexcept { arity = value; }
+
+  // A deferred function keeps its own copy of the tokens from its parameter
+  // list to its end-of-file marker until it is compiled.
+  bool is_compiled() const noexcept { return body.empty(); }
+  const Token_vector& get_body() const noexcept { return body; }
+
+  void defer(Token_vector tokens) noexcept {
+    ENSURES(!tokens.empty() && tokens.back().type == Token::eof);
+    chunk = Chunk{};
+    body = std::move(tokens);
+  }
+  Token_vector take_body() noexcept {
+    ENSURES(!is_compiled());
+    return std::exchange(body, Token_vector{});
+  }
 
-  size_t size() const noexcept override { return sizeof(Function); };
-  std::string to_string(bool verbose = false) const noexcept override {
+  size_t size() const noexcept {
+    auto size = sizeof(Function) + chunk.owned_bytes() +
+                captures.capacity() * sizeof(Capture) +
+                body.capacity() * sizeof(Token);
+    for (const auto& token : body) {
+      size += owned_bytes(token.lexeme);
+    }
+    return size;
+  };
+  std::string to_string(bool verbose = false) const noexcept {
     const std::string message =
-        name ? "<func: " + name->get_string() + ">" : "<script>";
+        name ? "<func: " + name->to_string() + ">" : "<script>";
     return verbose ? chunk.to_string(message, 1) : message;
   }
 
+  // How a closure of the function finds each of its upvalues when it is made:
+  // in a local slot of the frame making it, or among the upvalues of that
+  // frame's closure. Kept here, decoded, rather than after the Closure
+  // instruction. A local that is never assigned is copied into the closure
+  // rather than shared through an Upvalue.
+  struct Capture {
+    uint8_t index = 0;
+    bool is_local = false;
+    bool is_final = false;
+  };
+  using Capture_vector = std::vector<Capture>;
+
+  size_t get_upvalue_count() const noexcept { return captures.size(); }
+
   String* name = nullptr;
-  size_t upvalue_count = 0;
+  Capture_vector captures;
+  // A closure of a function that captures nothing is the same every time, so
+  // one is made on first use and shared.
+  Closure* closure = nullptr;
 
  private:
   Chunk chunk;
   size_t arity = 0;
+  Token_vector body;
 };
 
 class Native_func : public Object {
@@ -125,8 +275,8 @@ class Native_func : public Object {
     return (*func)(arg_count, args);
   }
 
-  size_t size() const noexcept override { return sizeof(Native_func); };
-  std::string to_string(bool = false) const noexcept override {
+  size_t size() const noexcept { return sizeof(Native_func); };
+  std::string to_string(bool = false) const noexcept {
     return "<native func>";
   }
 
@@ -139,8 +289,14 @@ class Upvalue : public Object {
   explicit Upvalue(Value* location) noexcept
       : Object{id_of<Upvalue>}, location{location} {}
 
-  size_t size() const noexcept override { return sizeof(Upvalue); };
-  std::string to_string(bool = false) const noexcept override {
+  Upvalue(Upvalue&& other) noexcept
+      : Object{std::move(other)},
+        location{other.location == &other.closed ? &closed : other.location},
+        closed{other.closed},
+        next{other.next} {}
+
+  size_t size() const noexcept { return sizeof(Upvalue); };
+  std::string to_string(bool = false) const noexcept {
     return "upvalue";
   }
 
@@ -149,31 +305,124 @@ class Upvalue : public Object {
   Upvalue* next = nullptr;
 };
 
+// The upvalues follow the closure in the same allocation, so making a closure
+// allocates once and reaching an upvalue takes one load less. Each is either
+// an Upvalue shared with the frame and other closures, or, for a captured
+// local that is never assigned, a copy of its value; no Lox value is ever an
+// Upvalue, so the two cannot be confused.
 class Closure : public Object {
  public:
-  using Upvalue_vector = std::vector<Upvalue*>;
+  static constexpr size_t size_for(size_t upvalue_count) noexcept {
+    return sizeof(Closure) + upvalue_count * sizeof(Value);
+  }
 
-  Closure(Function* func) noexcept
-      : Object{id_of<Closure>},
-        func{func},
-        upvalues{func->upvalue_count, nullptr} {}
+  Closure(const Closure&) noexcept = delete;
+  Closure& operator=(const Closure&) noexcept = delete;
 
   const Function* get_func() const noexcept { return func; }
   Function* get_func() noexcept { return func; }
+  void set_func(Function* value) noexcept { func = value; }
 
-  const Upvalue_vector& get_upvalues() const noexcept { return upvalues; }
-  Upvalue_vector& get_upvalues() noexcept { return upvalues; }
+  size_t get_upvalue_count() const noexcept { return upvalue_count; }
+  const Value* get_upvalues() const noexcept {
+    return reinterpret_cast<const Value*>(this + 1);
+  }
+  Value* get_upvalues() noexcept { return reinterpret_cast<Value*>(this + 1); }
 
-  size_t size() const noexcept override { return sizeof(Closure); };
-  std::string to_string(bool verbose = false) const noexcept override {
+  size_t size() const noexcept { return size_for(upvalue_count); };
+  std::string to_string(bool verbose = false) const noexcept {
     return func->to_string(verbose);
   }
 
  private:
+  friend class Heap;
+
+  explicit Closure(Function* func) noexcept
+      : Object{id_of<Closure>},
+        func{func},
+        upvalue_count{func->get_upvalue_count()} {
+    std::uninitialized_fill_n(get_upvalues(), upvalue_count, Value{});
+  }
+
+  Closure(Closure&& other) noexcept
+      : Object{std::move(other)},
+        func{other.func},
+        upvalue_count{other.upvalue_count} {
+    std::uninitialized_copy_n(other.get_upvalues(), upvalue_count,
+                              get_upvalues());
+  }
+
   Function* func;
-  Upvalue_vector upvalues;
+  size_t upvalue_count;
+};
+
+namespace detail {
+
+template <typename Types>
+struct Visit;
+
+template <typename T, typename... Ts>
+struct Visit<Type_list<T, Ts...>> {
+  template <typename Object_type, typename Visitor>
+  static decltype(auto) apply(Object_type& object, Visitor& visitor) noexcept {
+    if constexpr (sizeof...(Ts) == 0) {
+      return visitor(*object.template as<T>());
+    } else {
+      if (object.template is<T>()) {
+        return visitor(*object.template as<T>());
+      }
+      return Visit<Type_list<Ts...>>::apply(object, visitor);
+    }
+  }
 };
 
+}  // namespace detail
+
+template <typename Visitor>
+decltype(auto) Object::visit(Visitor&& visitor) noexcept {
+  return detail::Visit<Types>::apply(*this, visitor);
+}
+
+template <typename Visitor>
+decltype(auto) Object::visit(Visitor&& visitor) const noexcept {
+  return detail::Visit<Types>::apply(*this, visitor);
+}
+
+template <typename Visitor>
+void Rope::for_each_piece(Visitor&& visitor) const noexcept {
+  std::vector<const Object*> pending{this};
+  while (!pending.empty()) {
+    const auto object = pending.back();
+    pending.pop_back();
+    if (object->is<String>()) {
+      visitor(object->as<String>()->get_string());
+    } else if (const auto rope = object->as<Rope>(); rope->flat) {
+      visitor(rope->flat->get_string());
+    } else {
+      pending.push_back(rope->right);
+      pending.push_back(rope->left);
+    }
+  }
+}
+
+inline size_t Object::size() const noexcept {
+  return visit([](const auto& object) { return object.size(); });
+}
+
+inline std::string Object::to_string(bool verbose) const noexcept {
+  return visit(
+      [verbose](const auto& object) { return object.to_string(verbose); });
+}
+
+inline void Object::destroy() noexcept {
+  visit([](auto& object) {
+    using T = std::decay_t<decltype(object)>;
+    object.~T();
+  });
+}
+
+static_assert(sizeof(Object) <= sizeof(void*));
+
 }  // namespace lox
 
 #endif
@@ -0,0 +1,58 @@
+#ifndef LOX_OPTIONS_H
+#define LOX_OPTIONS_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace lox {
+
+struct Compile_options {
+  // Only bracket-match the bodies of top level functions and compile them on
+  // their first call.
+  bool lazy_functions = false;
+  // Parse deferred bodies up front anyway, so syntax errors in functions that
+  // are never called are still reported.
+  bool verify_lazy_functions = false;
+  // Record no line numbers, for embedders short of memory. Error messages
+  // still name the function but no longer the line.
+  bool strip_debug_info = false;
+};
+
+struct Gc_options {
+  // Bytes of old objects, and of the memory they own, at which the first
+  // collection starts.
+  size_t initial_heap = 1024 * 1024;
+  // A collection starts once the heap has grown to this multiple of what
+  // survived the last one, but not below min_heap and, while less than
+  // max_heap survives, not above max_heap, which wins over min_heap. A
+  // max_heap of 0 sets no limit.
+  double heap_grow_factor = 2;
+  size_t min_heap = 0;
+  size_t max_heap = 0;
+  // Longest time an incremental marking step may take. The last step of a
+  // cycle, which marks the roots again and sweeps, is not bounded.
+  std::chrono::microseconds max_pause{1000};
+  // Mark on a helper thread while the script runs. The script then only stops
+  // to mark the roots and for young collections.
+  bool concurrent_marking = false;
+  // Threads that mark the heap in the pause that ends a collection.
+  size_t marker_threads = 1;
+  // Move the survivors out of sparsely used pages after each full collection
+  // and give those pages back, so long running scripts do not fragment.
+  bool compact = false;
+  // Print the collector statistics after running a script.
+  bool report_stats = false;
+};
+
+struct Options {
+  Compile_options compile;
+  Gc_options gc;
+  // Directory of compiled script images keyed by the hash of their source.
+  // Caching is disabled when empty.
+  std::string cache_dir;
+};
+
+}  // namespace lox
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef LOX_SCANNER_H
 #define LOX_SCANNER_H
 
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -60,15 +61,15 @@ struct Token {
   };
 
   Token(Type type, int line) noexcept : type{type}, line{line} {}
-  Token(Type type, std::string lexeme, int line) noexcept
+  Token(Type type, std::pmr::string lexeme, int line) noexcept
       : type{type}, lexeme{std::move(lexeme)}, line{line} {}
 
   Type type;
-  std::string lexeme;
+  std::pmr::string lexeme;
   int line;
 };
 
-using Token_vector = std::vector<Token>;
+using Token_vector = std::pmr::vector<Token>;
 
 inline bool is_alpha(char ch) noexcept {
   return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
@@ -79,10 +80,13 @@ inline bool is_digit(char ch) noexcept { return ch >= '0' && ch <= '9'; }
 struct Scanner {
   explicit Scanner(std::string source) noexcept : source{std::move(source)} {}
 
-  Token_vector scan() {
+  // Tokens and their lexemes are allocated from the given resource.
+  Token_vector scan(std::pmr::memory_resource *memory_resource =
+                        std::pmr::get_default_resource()) {
     current = source.cbegin();
     line = 1;
-    Token_vector tokens;
+    resource = memory_resource;
+    Token_vector tokens{resource};
     while (true) {
       tokens.emplace_back(scan_token());
       if (tokens.back().type == Token::eof) {
@@ -180,10 +184,11 @@ struct Scanner {
   Token make_token(Token::Type type) const noexcept {
     if (type == Token::string) {
       ENSURES(std::distance(start, current) >= 1);
-      return {
-          type, {start + 1, start + std::distance(start, current) - 1}, line};
+      return {type,
+              {start + 1, start + std::distance(start, current) - 1, resource},
+              line};
     }
-    return {type, {start, current}, line};
+    return {type, {start, current, resource}, line};
   }
 
   bool is_at_end() const noexcept { return current == source.cend(); }
@@ -311,6 +316,7 @@ struct Scanner {
   std::string::const_iterator start;
   std::string::const_iterator current;
   int line;
+  std::pmr::memory_resource *resource = nullptr;
 };
 
 }  // namespace lox
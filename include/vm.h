@@ -1,6 +1,7 @@
 #ifndef LOX_VM_H
 #define LOX_VM_H
 
+#include <optional>
 #include <ostream>
 #include <string>
 
@@ -9,9 +10,11 @@
 #include "gc.h"
 #include "hash_table.h"
 #include "heap.h"
+#include "image.h"
 #include "instruction.h"
 #include "native.h"
 #include "object.h"
+#include "options.h"
 #include "scanner.h"
 #include "stack.h"
 #include "value.h"
@@ -20,16 +23,22 @@ namespace lox {
 
 class VM {
  public:
-  explicit VM(std::ostream& os) noexcept
+  explicit VM(std::ostream& os, const Options& options = {}) noexcept
       : out{&os},
-        compiler{heap},
-        gc{heap, globals, stack, call_frames, compiler} {
+        compile_options{options.compile},
+        compiler{heap, options.compile},
+        gc{heap, globals, stack, call_frames, compiler, options.gc} {
+    if (!options.cache_dir.empty()) {
+      cache.emplace(options.cache_dir);
+    }
     register_natives(globals, heap);
   }
 
   template <bool Debug = false>
   inline void interpret(std::string source) noexcept;
 
+  const Gc_stats& get_gc_stats() const noexcept { return gc.get_stats(); }
+
   template <typename Instruction>
   void handle(const Instruction&) {
     EXPECTS(false);
@@ -88,17 +97,28 @@ class VM {
     return call_frames.peek();
   }
 
+  // Open upvalues are sorted from the top of the stack down, so the ones at or
+  // above last come first; once closed they leave the list.
   void close_upvalues(const Value* last) noexcept {
-    const auto& open_upvalues = heap.get_open_upvalues();
-    for (auto it = open_upvalues.begin(); it != open_upvalues.end(); ++it) {
-      if (it->location >= last) {
-        it->closed = *it->location;
-        it->location = &it->closed;
-      }
+    auto& open_upvalues = heap.get_open_upvalues();
+    while (!open_upvalues.empty() &&
+           open_upvalues.front()->location >= last) {
+      const auto guard = heap.guard_marker();
+      const auto upvalue = open_upvalues.pop_front();
+      heap.write_barrier(upvalue, upvalue->closed, *upvalue->location);
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
     }
   }
 
   void call_closure(Closure& closure, size_t argument_count) {
+    if (auto func = closure.get_func(); !func->is_compiled()) {
+      const auto guard = heap.guard_marker();
+      const auto old_size = func->size();
+      compiler.compile(*func);
+      heap.resized(func, old_size);
+      heap.write_barrier(func);
+    }
     if (!call_frames.empty()) {
       top_frame().ip = executor.ip;
     }
@@ -110,7 +130,27 @@ class VM {
     }
   }
 
+  // Objects only move or die here, so the executor is reloaded afterwards.
+  void safepoint() noexcept {
+    if (gc.is_collection_requested()) {
+      top_frame().ip = executor.ip;
+      gc.collect_if_requested();
+      executor.copy_from(top_frame());
+    }
+  }
+
+  Closure* load_script(std::string source);
+  void compile_lazy_functions(const Function& script);
+
   bool concat_string(Value left, Value right) noexcept;
+  String* flatten(Rope& rope) noexcept;
+  // Ropes are flattened before they are compared, printed or passed to a
+  // native function, which all expect interned strings.
+  Value flattened(Value value) noexcept {
+    return value.is_object() && value.as_object()->is<Rope>()
+               ? flatten(*value.as_object()->as<Rope>())
+               : value;
+  }
 
   void throw_runtime_error(const char* message);
   void throw_undefined_variable(const String* name);
@@ -118,6 +158,8 @@ class VM {
 
   void backtrace() const noexcept;
 
+  // Shorter concatenations of two strings are copied right away.
+  constexpr static size_t min_rope_length = 64;
   constexpr static size_t max_frame_size = 64;
   constexpr static size_t max_stacksize = max_frame_size * 256;
 
@@ -125,6 +167,7 @@ class VM {
   using Call_frame_stack = Stack<Call_frame, max_frame_size>;
 
   std::ostream* out;
+  Compile_options compile_options;
   Heap heap;
   Hash_table globals;
   Value_stack stack;
@@ -132,6 +175,10 @@ class VM {
   Compiler compiler;
   GC<Heap, Hash_table, Value_stack, Call_frame_stack, Compiler> gc;
   Executor executor;
+  std::optional<Compile_cache> cache;
+  // Reused for every concatenation and flattening, so that it does not
+  // allocate once grown.
+  std::string concat_buffer;
 };
 
 template <>
@@ -185,6 +232,7 @@ inline void VM::handle(const instruction::Define_global& define_global) {
   const auto constant = executor.constant_at(define_global.operand());
   const auto name = constant.as_object()->as<String>();
   auto* str = heap.make_string(name->get_string());
+  heap.write_barrier(globals, str, stack.peek());
   globals.insert(str, stack.pop());
 }
 
@@ -195,26 +243,37 @@ inline void VM::handle(const instruction::Set_global& set_global) {
   if (!globals.set(name, stack.peek())) {
     throw_undefined_variable(name);
   }
+  heap.write_barrier(globals, name, stack.peek());
 }
 
 template <>
 inline void VM::handle(const instruction::Get_upvalue& get_upvalue) {
   const auto slot = get_upvalue.operand();
-  ENSURES(slot < top_frame().closure->get_upvalues().size());
-  stack.push(*top_frame().closure->get_upvalues()[slot]->location);
+  ENSURES(slot < top_frame().closure->get_upvalue_count());
+  const auto value = top_frame().closure->get_upvalues()[slot];
+  if (value.is_object() && value.as_object()->is<Upvalue>()) {
+    stack.push(*value.as_object()->as<Upvalue>()->location);
+  } else {
+    stack.push(value);
+  }
 }
 
 template <>
 inline void VM::handle(const instruction::Set_upvalue& set_upvalue) {
   auto slot = set_upvalue.operand();
-  ENSURES(slot < top_frame().closure->get_upvalues().size());
-  *top_frame().closure->get_upvalues()[slot]->location = stack.peek();
+  ENSURES(slot < top_frame().closure->get_upvalue_count());
+  // Only locals that are assigned are captured as Upvalues.
+  auto upvalue =
+      top_frame().closure->get_upvalues()[slot].as_object()->as<Upvalue>();
+  const auto guard = heap.guard_marker();
+  heap.write_barrier(upvalue, *upvalue->location, stack.peek());
+  *upvalue->location = stack.peek();
 }
 
 template <>
 inline void VM::handle(const instruction::Equal&) {
-  const auto right = stack.pop();
-  const auto left = stack.pop();
+  const auto right = flattened(stack.pop());
+  const auto left = flattened(stack.pop());
   stack.push(left == right);
 }
 
@@ -271,7 +330,7 @@ inline void VM::handle(const instruction::Negate&) {
 template <>
 inline void VM::handle(const instruction::Print&) {
   ENSURES(!stack.empty());
-  *out << to_string(stack.pop()) << "\n";
+  *out << to_string(flattened(stack.pop())) << "\n";
 }
 
 template <>
@@ -290,6 +349,7 @@ inline void VM::handle(const instruction::Jump_if_false& jump_if_false) {
 template <>
 inline void VM::handle(const instruction::Loop& loop) {
   executor.ip -= loop.operand();
+  safepoint();
 }
 
 template <>
@@ -302,11 +362,15 @@ inline void VM::handle(const instruction::Call& call) {
       const auto arity = closure->get_func()->get_arity();
       if (argument_count == arity) {
         call_closure(*closure, argument_count);
+        safepoint();
         return;
       }
       throw_incorrect_argument_count(arity, argument_count);
     } else if (object->is<Native_func>()) {
       const auto func = object->as<Native_func>();
+      for (size_t i = stack.size() - argument_count; i < stack.size(); ++i) {
+        stack[i] = flattened(stack[i]);
+      }
       const auto result = (*func)(
           argument_count,
           argument_count > 0 ? &stack[stack.size() - argument_count] : nullptr);
@@ -322,20 +386,31 @@ template <>
 inline void VM::handle(const instruction::Closure& closure_instr) {
   auto value = executor.constant_at(closure_instr.operand());
   auto* func = value.as_object()->as<Function>();
-  auto* closure = heap.make_object<Closure>(func);
+  if (func->captures.empty()) {
+    if (!func->closure) {
+      const auto closure = heap.make_closure(func);
+      const auto guard = heap.guard_marker();
+      heap.write_barrier(func, Value{}, closure);
+      func->closure = closure;
+    }
+    stack.push(func->closure);
+    return;
+  }
+  auto* closure = heap.make_closure(func);
   stack.push(closure);
-  const auto upvalues = closure_instr.upvalues();
-  for (size_t i = 0; i < func->upvalue_count; ++i) {
-    auto is_local = upvalues[i * 2];
-    auto index = upvalues[i * 2 + 1];
-    if (is_local) {
-      auto value = &stack[top_frame().bottom_of_stack + index];
-      closure->get_upvalues()[i] = heap.make_upvalue(value);
+  const auto upvalues = closure->get_upvalues();
+  const auto& captures = func->captures;
+  for (size_t i = 0; i < captures.size(); ++i) {
+    if (captures[i].is_local) {
+      auto& local = stack[top_frame().bottom_of_stack + captures[i].index];
+      upvalues[i] =
+          captures[i].is_final ? local : Value{heap.make_upvalue(&local)};
     } else {
-      closure->get_upvalues()[i] = top_frame().closure->get_upvalues()[index];
+      upvalues[i] = top_frame().closure->get_upvalues()[captures[i].index];
     }
   }
-  executor.ip += func->upvalue_count * 2;
+  // A closure with many upvalues is too large for the nursery.
+  heap.write_barrier(closure);
 }
 
 template <>
@@ -356,6 +431,7 @@ inline void VM::handle(const instruction::Return&) {
     stack.resize(stacksize);
     stack.push(result);
     executor.copy_from(top_frame());
+    safepoint();
   }
 }
 
@@ -370,11 +446,7 @@ inline void VM::handle(const instruction::Return&) {
 template <bool Debug>
 inline void VM::interpret(std::string source) noexcept {
   try {
-    lox::Scanner scanner{std::move(source)};
-    auto func = compiler.compile(scanner.scan());
-    auto closure = heap.make_object<Closure>(func);
-    stack.push(closure);
-    call_closure(*closure, 0);
+    call_closure(*load_script(std::move(source)), 0);
     while (executor.ip != executor.end) {
       switch (*executor.ip) { INSTRUCTIONS(INTERPRET_CASE) }
       if constexpr (Debug) {
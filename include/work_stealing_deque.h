@@ -0,0 +1,124 @@
+#ifndef LOX_WORK_STEALING_DEQUE_H
+#define LOX_WORK_STEALING_DEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "contract.h"
+
+namespace lox {
+
+// Chase-Lev deque: the owner thread pushes and pops at the bottom, any other
+// thread may steal from the top. Follows "Correct and Efficient Work-Stealing
+// for Weak Memory Models" (Le et al., 2013). Arrays outgrown by the owner are
+// kept until destruction, since a thief may still be reading one.
+template <typename T>
+class Work_stealing_deque {
+ public:
+  explicit Work_stealing_deque(size_t capacity = 1024) noexcept {
+    EXPECTS(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    arrays.push_back(std::make_unique<Array>(capacity));
+    array.store(arrays.back().get(), std::memory_order_relaxed);
+  }
+
+  Work_stealing_deque(const Work_stealing_deque&) noexcept = delete;
+  Work_stealing_deque(Work_stealing_deque&&) noexcept = delete;
+  Work_stealing_deque& operator=(const Work_stealing_deque&) noexcept = delete;
+  Work_stealing_deque& operator=(Work_stealing_deque&&) noexcept = delete;
+
+  // Owner only.
+  void push(T* item) noexcept {
+    const auto b = bottom.load(std::memory_order_relaxed);
+    const auto t = top.load(std::memory_order_acquire);
+    auto a = array.load(std::memory_order_relaxed);
+    if (b - t > static_cast<int64_t>(a->capacity) - 1) {
+      a = grow(a, t, b);
+    }
+    a->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only. Returns nullptr when empty.
+  T* pop() noexcept {
+    const auto b = bottom.load(std::memory_order_relaxed) - 1;
+    const auto a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    auto item = a->get(b);
+    if (t == b) {
+      // The last item: race the thieves for it.
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        item = nullptr;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Any thread. Returns nullptr when empty or when another thread won.
+  T* steal() noexcept {
+    auto t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    const auto item = array.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+  // Only a hint while other threads use the deque.
+  bool empty() const noexcept {
+    return top.load(std::memory_order_relaxed) >=
+           bottom.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Array {
+    explicit Array(size_t capacity) noexcept
+        : capacity{capacity},
+          items{std::make_unique<std::atomic<T*>[]>(capacity)} {}
+
+    T* get(int64_t index) const noexcept {
+      return items[index & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    void put(int64_t index, T* item) noexcept {
+      items[index & (capacity - 1)].store(item, std::memory_order_relaxed);
+    }
+
+    const size_t capacity;
+    std::unique_ptr<std::atomic<T*>[]> items;
+  };
+
+  Array* grow(const Array* from, int64_t t, int64_t b) noexcept {
+    arrays.push_back(std::make_unique<Array>(from->capacity * 2));
+    const auto to = arrays.back().get();
+    for (auto i = t; i < b; ++i) {
+      to->put(i, from->get(i));
+    }
+    array.store(to, std::memory_order_release);
+    return to;
+  }
+
+  std::atomic<int64_t> top{0};
+  std::atomic<int64_t> bottom{0};
+  std::atomic<Array*> array;
+  std::vector<std::unique_ptr<Array>> arrays;
+};
+
+}  // namespace lox
+
+#endif
@@ -1,37 +1,142 @@
 #define DOCTEST_CONFIG_IMPLEMENT
 #include <doctest/doctest.h>
 
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <utility>
 
 #include "compiler.h"
+#include "options.h"
 #include "scanner.h"
 #include "vm.h"
 
 namespace lox {
 
-inline void repl() noexcept {
+inline void repl(const Options &options) noexcept {
   while (true) {
     std::cout << "> ";
     std::string source;
     std::getline(std::cin, source);
-    VM{std::cout}.interpret(std::move(source));
+    VM{std::cout, options}.interpret(std::move(source));
   }
 }
 
-inline void run_file(const std::string &filepath) {
+inline void print_gc_stats(const Gc_stats &stats) noexcept {
+  stats.for_each([](const char *name, auto value) {
+    std::cerr << "gc: " << name << " " << value << "\n";
+  });
+  std::cerr << "gc: pause_histogram";
+  const auto histogram = stats.pauses.histogram();
+  for (size_t i = 0; i < histogram.size(); ++i) {
+    if (histogram[i] > 0) {
+      const auto last = i + 1 == histogram.size();
+      std::cerr << (last ? " >=" : " <") << (1ll << (last ? i - 1 : i))
+                << "us:" << histogram[i];
+    }
+  }
+  std::cerr << "\n";
+}
+
+inline void run_file(const std::string &filepath,
+                     const Options &options = {}) {
   std::ifstream ifs(filepath);
-  VM{std::cout}.interpret(std::string{std::istreambuf_iterator<char>{ifs},
-                                      std::istreambuf_iterator<char>{}});
+  VM vm{std::cout, options};
+  vm.interpret(std::string{std::istreambuf_iterator<char>{ifs},
+                           std::istreambuf_iterator<char>{}});
+  if (options.gc.report_stats) {
+    print_gc_stats(vm.get_gc_stats());
+  }
+}
+
+inline bool parse_option(const std::string &option, Options &options) noexcept {
+  if (option == "--lazy") {
+    options.compile.lazy_functions = true;
+  } else if (option == "--verify-lazy") {
+    options.compile.lazy_functions = true;
+    options.compile.verify_lazy_functions = true;
+  } else if (option == "--strip-debug-info") {
+    options.compile.strip_debug_info = true;
+  } else if (const std::string key = "--cache-dir="; option.rfind(key, 0) == 0) {
+    options.cache_dir = option.substr(key.size());
+  } else if (const std::string key = "--gc-max-pause=";
+             option.rfind(key, 0) == 0) {
+    options.gc.max_pause = std::chrono::microseconds{
+        std::strtoul(option.c_str() + key.size(), nullptr, 10)};
+  } else if (const std::string key = "--gc-initial-heap=";
+             option.rfind(key, 0) == 0) {
+    options.gc.initial_heap =
+        std::strtoull(option.c_str() + key.size(), nullptr, 10);
+  } else if (const std::string key = "--gc-grow-factor=";
+             option.rfind(key, 0) == 0) {
+    const auto factor = std::strtod(option.c_str() + key.size(), nullptr);
+    if (!(factor >= 1)) {
+      return false;
+    }
+    options.gc.heap_grow_factor = factor;
+  } else if (const std::string key = "--gc-min-heap=";
+             option.rfind(key, 0) == 0) {
+    options.gc.min_heap =
+        std::strtoull(option.c_str() + key.size(), nullptr, 10);
+  } else if (const std::string key = "--gc-max-heap=";
+             option.rfind(key, 0) == 0) {
+    options.gc.max_heap =
+        std::strtoull(option.c_str() + key.size(), nullptr, 10);
+  } else if (const std::string key = "--gc-threads=";
+             option.rfind(key, 0) == 0) {
+    options.gc.marker_threads =
+        std::strtoul(option.c_str() + key.size(), nullptr, 10);
+  } else if (option == "--gc-concurrent") {
+    options.gc.concurrent_marking = true;
+  } else if (option == "--gc-compact") {
+    options.gc.compact = true;
+  } else if (option == "--gc-stats") {
+    options.gc.report_stats = true;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline Options default_options() noexcept {
+  Options options;
+  if (const auto cache_dir = std::getenv("LOX_CACHE_DIR"); cache_dir) {
+    options.cache_dir = cache_dir;
+  }
+  // Options given on the command line override these.
+  const std::pair<const char *, const char *> gc_variables[] = {
+      {"LOX_GC_INITIAL_HEAP", "--gc-initial-heap="},
+      {"LOX_GC_GROW_FACTOR", "--gc-grow-factor="},
+      {"LOX_GC_MIN_HEAP", "--gc-min-heap="},
+      {"LOX_GC_MAX_HEAP", "--gc-max-heap="},
+  };
+  for (const auto &[variable, option] : gc_variables) {
+    if (const auto value = std::getenv(variable); value) {
+      parse_option(option + std::string{value}, options);
+    }
+  }
+  return options;
 }
 
 inline int main(int argc, char *argv[]) noexcept {
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  auto options = default_options();
+  int index = 1;
+  while (index < argc && parse_option(argv[index], options)) {
+    ++index;
+  }
+  if (index == argc) {
+    repl(options);
+  } else if (index == argc - 1) {
+    run_file(argv[index], options);
   } else {
-    fprintf(stderr, "Usage: lox [path]\n");
+    fprintf(stderr,
+            "Usage: lox [--lazy] [--verify-lazy] [--strip-debug-info] "
+            "[--cache-dir=<dir>] [--gc-initial-heap=<bytes>] "
+            "[--gc-grow-factor=<factor>] [--gc-min-heap=<bytes>] "
+            "[--gc-max-heap=<bytes>] [--gc-max-pause=<microseconds>] "
+            "[--gc-threads=<count>] [--gc-concurrent] [--gc-compact] "
+            "[--gc-stats] [path]\n");
   }
   return 0;
 }
@@ -51,7 +156,11 @@ int main(int argc, char *argv[]) {
   }
 
   if (argc > 1) {
-    lox::run_file(argv[argc - 1]);
+    auto options = lox::default_options();
+    for (int i = 1; i < argc - 1; ++i) {
+      lox::parse_option(argv[i], options);
+    }
+    lox::run_file(argv[argc - 1], options);
   }
   return res;
 #endif
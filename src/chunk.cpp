@@ -8,24 +8,21 @@
 
 namespace lox {
 
-static std::pair<std::string, size_t> upvalues_to_string(
-    const instruction::Closure& closure,
-    const Value_vector& constants) noexcept {
+static std::string upvalues_to_string(const instruction::Closure& closure,
+                                      const Value_vector& constants) noexcept {
   ENSURES(closure.operand() < constants.size());
   const auto value = constants[closure.operand()];
   ENSURES(value.is_object() && value.as_object()->is<Function>());
   const auto* func = value.as_object()->template as<Function>();
 
   std::string result;
-  const auto* code = closure.get_code();
-  size_t upvalue_pos = closure.size;
-  for (size_t i = 0; i < func->upvalue_count; ++i) {
-    const auto is_local = code[upvalue_pos++];
-    const auto index = code[upvalue_pos++];
-    result += std::string{" "} + (is_local ? "local" : "upvalue") + " " +
-              std::to_string(index) + ",";
+  for (const auto& capture : func->captures) {
+    const auto kind =
+        capture.is_local ? (capture.is_final ? "copy" : "local") : "upvalue";
+    result += std::string{" "} + kind + " " + std::to_string(capture.index) +
+              ",";
   }
-  return {result, upvalue_pos};
+  return result;
 }
 
 static std::string operand_to_string(const instruction::Simple_instr&, size_t,
@@ -78,9 +75,7 @@ static std::pair<std::string, size_t> to_string(
   std::ostringstream oss;
   oss << instr.name << operand_to_string(instr, pos, constants);
   if constexpr (std::is_same_v<Instruction, instruction::Closure>) {
-    auto [string, size] = upvalues_to_string(instr, constants);
-    oss << "        upvalues: " + string;
-    return {oss.str(), size};
+    oss << "        upvalues: " + upvalues_to_string(instr, constants);
   }
   return {oss.str(), instr.size};
 }
@@ -89,12 +84,14 @@ std::string Chunk::to_string(const std::string& name, int level) const
     noexcept {
   std::string result = level == 0 ? "== " + name + " ==\n" : name + "\n";
   size_t pos = 0;
+  auto run = lines.cbegin();
   while (pos < code.size()) {
     std::ostringstream oss;
     oss << std::string(level * 4, ' ') << std::setfill('0') << std::setw(4)
         << pos << " ";
-    if (pos == 0 || lines[pos] != lines[pos - 1]) {
-      oss << std::setfill(' ') << std::setw(4) << lines[pos] << " ";
+    if (run != lines.cend() && run->start <= pos) {
+      oss << std::setfill(' ') << std::setw(4) << run->line << " ";
+      ++run;
     } else {
       oss << "   | ";
     }
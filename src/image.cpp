@@ -0,0 +1,408 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gc.h"
+
+namespace lox {
+
+namespace image {
+
+namespace {
+
+constexpr char magic[4] = {'L', 'O', 'X', 'B'};
+constexpr uint32_t byte_order_mark = 0x01020304;
+constexpr uint32_t no_name = UINT32_MAX;
+
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t string_count;
+  uint32_t function_count;
+  uint32_t reserved;
+  uint64_t source_hash;
+};
+
+struct Function_header {
+  uint32_t name;
+  uint32_t arity;
+  uint32_t upvalue_count;
+  uint32_t code_size;
+  uint32_t constant_count;
+  uint32_t line_run_count;
+};
+
+enum Constant_tag : uint32_t { t_nil, t_bool, t_number, t_string, t_function };
+
+struct Constant {
+  uint32_t tag;
+  uint32_t index;
+  double number;
+};
+
+class Writer {
+ public:
+  bool collect(const Function& func) noexcept {
+    if (function_indices.count(&func) > 0) {
+      return true;
+    }
+    if (!func.is_compiled()) {
+      return false;
+    }
+    if (func.name) {
+      add_string(func.name);
+    }
+    for (auto constant : func.get_chunk().get_constants()) {
+      if (constant.is_object()) {
+        const auto object = constant.as_object();
+        if (object->is<String>()) {
+          add_string(object->as<String>());
+        } else if (!object->is<Function>() ||
+                   !collect(*object->as<Function>())) {
+          return false;
+        }
+      }
+    }
+    function_indices.emplace(&func, functions.size());
+    functions.push_back(&func);
+    return true;
+  }
+
+  std::string write(uint64_t source_hash) noexcept {
+    Header header{};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.byte_order = byte_order_mark;
+    header.string_count = strings.size();
+    header.function_count = functions.size();
+    header.source_hash = source_hash;
+    append(header);
+
+    for (auto string : strings) {
+      const auto& str = string->get_string();
+      append(static_cast<uint32_t>(str.size()));
+      out.append(str);
+    }
+    for (auto func : functions) {
+      write(*func);
+    }
+    return std::move(out);
+  }
+
+ private:
+  void add_string(const String* string) noexcept {
+    if (string_indices.count(string) == 0) {
+      string_indices.emplace(string, strings.size());
+      strings.push_back(string);
+    }
+  }
+
+  void write(const Function& func) noexcept {
+    const auto& chunk = func.get_chunk();
+    const auto& code = chunk.get_code();
+    const auto& lines = chunk.get_lines();
+    const auto& constants = chunk.get_constants();
+
+    Function_header header;
+    header.name = func.name ? string_indices.at(func.name) : no_name;
+    header.arity = func.get_arity();
+    header.upvalue_count = func.get_upvalue_count();
+    header.code_size = code.size();
+    header.constant_count = constants.size();
+    header.line_run_count = lines.size();
+    append(header);
+
+    out.append(reinterpret_cast<const char*>(code.data()), code.size());
+    for (const auto& capture : func.captures) {
+      append(capture);
+    }
+    for (const auto& run : lines) {
+      append(run);
+    }
+    for (auto value : constants) {
+      append(constant_of(value));
+    }
+  }
+
+  Constant constant_of(Value value) const noexcept {
+    Constant constant{};
+    if (value.is_bool()) {
+      constant.tag = t_bool;
+      constant.index = value.as_bool();
+    } else if (value.is_double()) {
+      constant.tag = t_number;
+      constant.number = value.as_double();
+    } else if (value.is_object()) {
+      const auto object = value.as_object();
+      if (object->is<String>()) {
+        constant.tag = t_string;
+        constant.index = string_indices.at(object->as<String>());
+      } else {
+        constant.tag = t_function;
+        constant.index = function_indices.at(object->as<Function>());
+      }
+    } else {
+      constant.tag = t_nil;
+    }
+    return constant;
+  }
+
+  template <typename T>
+  void append(const T& value) noexcept {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  std::vector<const String*> strings;
+  std::unordered_map<const String*, uint32_t> string_indices;
+  std::vector<const Function*> functions;
+  std::unordered_map<const Function*, uint32_t> function_indices;
+  std::string out;
+};
+
+class Reader {
+ public:
+  Reader(const char* data, size_t size) noexcept : data{data}, size{size} {}
+
+  template <typename T>
+  bool read(T& value) noexcept {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (const auto bytes = take(sizeof(T)); bytes) {
+      std::memcpy(&value, bytes, sizeof(T));
+      return true;
+    }
+    return false;
+  }
+
+  const char* take(size_t count) noexcept {
+    if (size - pos < count) {
+      return nullptr;
+    }
+    const auto result = data + pos;
+    pos += count;
+    return result;
+  }
+
+  size_t remaining() const noexcept { return size - pos; }
+
+ private:
+  const char* data;
+  size_t size;
+  size_t pos = 0;
+};
+
+Function* read_function(Reader& reader, const std::vector<String*>& strings,
+                        const std::vector<Function*>& functions,
+                        Heap& heap) noexcept {
+  Function_header header;
+  if (!reader.read(header) ||
+      (header.name != no_name && header.name >= strings.size()) ||
+      header.upvalue_count > UINT8_MAX + 1 ||
+      header.line_run_count > reader.remaining() / sizeof(Chunk::Line_run) ||
+      header.constant_count > reader.remaining() / sizeof(Constant)) {
+    return nullptr;
+  }
+  const auto code = reinterpret_cast<const Bytecode*>(
+      reader.take(header.code_size));
+  if (!code) {
+    return nullptr;
+  }
+  Function::Capture_vector captures(header.upvalue_count);
+  for (auto& capture : captures) {
+    if (!reader.read(capture)) {
+      return nullptr;
+    }
+  }
+  Chunk::Line_run_vector lines(header.line_run_count);
+  for (auto& run : lines) {
+    if (!reader.read(run)) {
+      return nullptr;
+    }
+  }
+
+  auto func = heap.make_object<Function>();
+  func->name = header.name != no_name ? strings[header.name] : nullptr;
+  func->set_arity(header.arity);
+  func->captures = std::move(captures);
+  auto& chunk = func->get_chunk();
+  chunk.assign({code, code + header.code_size}, std::move(lines));
+  for (uint32_t i = 0; i < header.constant_count; ++i) {
+    Constant constant;
+    if (!reader.read(constant)) {
+      return nullptr;
+    }
+    switch (constant.tag) {
+      case t_nil:
+        chunk.add_constant();
+        break;
+      case t_bool:
+        chunk.add_constant(constant.index != 0);
+        break;
+      case t_number:
+        chunk.add_constant(constant.number);
+        break;
+      case t_string:
+        if (constant.index >= strings.size()) {
+          return nullptr;
+        }
+        chunk.add_constant(strings[constant.index]);
+        break;
+      case t_function:
+        if (constant.index >= functions.size()) {
+          return nullptr;
+        }
+        chunk.add_constant(functions[constant.index]);
+        break;
+      default:
+        return nullptr;
+    }
+  }
+  return func;
+}
+
+}  // namespace
+
+uint64_t hash_of(const std::string& source, bool stripped) noexcept {
+  uint64_t hash = 14695981039346656037ull;
+  for (const auto ch : source) {
+    hash ^= static_cast<unsigned char>(ch);
+    hash *= 1099511628211ull;
+  }
+  // Images with and without line information must not share a cache entry.
+  return stripped ? ~hash : hash;
+}
+
+std::string save(const Function& script, uint64_t source_hash) noexcept {
+  Writer writer;
+  if (!writer.collect(script)) {
+    return {};
+  }
+  return writer.write(source_hash);
+}
+
+Function* load(const char* data, size_t size, Heap& heap,
+               uint64_t source_hash) noexcept {
+  // Nothing refers to the loaded objects until the script is returned.
+  Memory_tracker::Pause_guard pause;
+
+  Reader reader{data, size};
+  Header header;
+  if (!reader.read(header) ||
+      std::memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+      header.version != version || header.byte_order != byte_order_mark ||
+      (source_hash != 0 && header.source_hash != source_hash) ||
+      header.function_count == 0) {
+    return nullptr;
+  }
+
+  std::vector<String*> strings;
+  for (uint32_t i = 0; i < header.string_count; ++i) {
+    uint32_t length;
+    if (!reader.read(length)) {
+      return nullptr;
+    }
+    const auto chars = reader.take(length);
+    if (!chars) {
+      return nullptr;
+    }
+    strings.push_back(heap.make_string({chars, length}));
+  }
+
+  std::vector<Function*> functions;
+  for (uint32_t i = 0; i < header.function_count; ++i) {
+    const auto func = read_function(reader, strings, functions, heap);
+    if (!func) {
+      return nullptr;
+    }
+    functions.push_back(func);
+  }
+  return reader.remaining() == 0 ? functions.back() : nullptr;
+}
+
+}  // namespace image
+
+namespace {
+
+class Mapped_file {
+ public:
+  explicit Mapped_file(const std::string& path) noexcept {
+    const auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      const auto address =
+          ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address != MAP_FAILED) {
+        data = static_cast<const char*>(address);
+        size = st.st_size;
+      }
+    }
+    ::close(fd);
+  }
+
+  ~Mapped_file() noexcept {
+    if (data) {
+      ::munmap(const_cast<char*>(data), size);
+    }
+  }
+
+  Mapped_file(const Mapped_file&) noexcept = delete;
+  Mapped_file& operator=(const Mapped_file&) noexcept = delete;
+
+  const char* data = nullptr;
+  size_t size = 0;
+};
+
+}  // namespace
+
+Function* Compile_cache::load(uint64_t source_hash, Heap& heap) const
+    noexcept {
+  const Mapped_file file{path_of(source_hash)};
+  return file.data ? image::load(file.data, file.size, heap, source_hash)
+                   : nullptr;
+}
+
+bool Compile_cache::store(uint64_t source_hash, const Function& script) const
+    noexcept {
+  const auto bytes = image::save(script, source_hash);
+  if (bytes.empty()) {
+    return false;
+  }
+  ::mkdir(directory.c_str(), 0755);
+  const auto path = path_of(source_hash);
+  const auto temp_path = path + "." + std::to_string(::getpid()) + ".tmp";
+  {
+    std::ofstream ofs{temp_path, std::ios::binary | std::ios::trunc};
+    ofs.write(bytes.data(), bytes.size());
+    ofs.close();
+    if (!ofs) {
+      std::remove(temp_path.c_str());
+      return false;
+    }
+  }
+  return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+std::string Compile_cache::path_of(uint64_t source_hash) const noexcept {
+  std::ostringstream oss;
+  oss << directory << "/" << std::hex << std::setfill('0') << std::setw(16)
+      << source_hash << ".v" << std::dec << image::version << ".loxc";
+  return oss.str();
+}
+
+}  // namespace lox
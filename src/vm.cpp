@@ -4,25 +4,88 @@
 
 namespace lox {
 
+Closure* VM::load_script(std::string source) {
+  // The script function is not reachable from any root until its closure is on
+  // the stack.
+  Memory_tracker::Pause_guard pause;
+  const auto source_hash =
+      cache ? image::hash_of(source, compile_options.strip_debug_info) : 0;
+  Function* func = cache ? cache->load(source_hash, heap) : nullptr;
+  if (!func) {
+    std::pmr::monotonic_buffer_resource token_arena;
+    Scanner scanner{std::move(source)};
+    func = compiler.compile(scanner.scan(&token_arena));
+    if (cache) {
+      compile_lazy_functions(*func);
+      cache->store(source_hash, *func);
+    }
+  }
+  auto closure = heap.make_closure(func);
+  stack.push(closure);
+  return closure;
+}
+
+void VM::compile_lazy_functions(const Function& script) {
+  for (auto constant : script.get_chunk().get_constants()) {
+    if (constant.is_object() && constant.as_object()->is<Function>()) {
+      if (auto func = constant.as_object()->as<Function>();
+          !func->is_compiled()) {
+        compiler.compile(*func);
+      }
+    }
+  }
+}
+
 bool VM::concat_string(Value left, Value right) noexcept {
   if (left.is_object() && right.is_object()) {
     auto obj_left = left.as_object();
     auto obj_right = right.as_object();
-    if (obj_left->is<String>() && obj_right->is<String>()) {
-      stack.push(heap.make_string(obj_left->as<String>()->get_string() +
-                                  obj_right->as<String>()->get_string()));
+    if (Rope::is_text(obj_left) && Rope::is_text(obj_right)) {
+      const auto length =
+          Rope::length_of(obj_left) + Rope::length_of(obj_right);
+      if (length < min_rope_length && obj_left->is<String>() &&
+          obj_right->is<String>()) {
+        concat_buffer.assign(obj_left->as<String>()->get_string());
+        concat_buffer.append(obj_right->as<String>()->get_string());
+        stack.push(heap.make_string(concat_buffer));
+      } else {
+        // A flattened half is replaced by its string, so that its pieces can
+        // be collected.
+        const auto half = [](Object* object) -> Object* {
+          const auto rope = object->is<Rope>() ? object->as<Rope>() : nullptr;
+          return rope && rope->flat ? rope->flat : object;
+        };
+        stack.push(heap.make_object<Rope>(half(obj_left), half(obj_right),
+                                          length));
+      }
       return true;
     }
   }
   return false;
 }
 
+String* VM::flatten(Rope& rope) noexcept {
+  if (rope.flat) {
+    return rope.flat;
+  }
+  concat_buffer.clear();
+  concat_buffer.reserve(rope.get_length());
+  rope.for_each_piece(
+      [this](std::string_view piece) { concat_buffer.append(piece); });
+  const auto flat = heap.make_string(concat_buffer);
+  const auto guard = heap.guard_marker();
+  heap.write_barrier(&rope, rope.left, flat);
+  heap.write_barrier(&rope, rope.right, Value{});
+  rope.set_flat(flat);
+  return flat;
+}
+
 void VM::throw_runtime_error(const char* message) {
   throw Runtime_error{message};
 }
 
 void VM::throw_undefined_variable(const String* name) {
-  throw Runtime_error{"Undefined variable '" + name->get_string() + "'."};
+  throw Runtime_error{"Undefined variable '" + name->to_string() + "'."};
 }
 
 void VM::throw_incorrect_argument_count(int arity, int argument_count) {
@@ -35,10 +98,13 @@ void VM::backtrace() const noexcept {
   for (size_t distance = 0; distance < call_frames.size(); ++distance) {
     auto& frame = call_frames.peek(distance);
     auto func = frame.closure->get_func();
-    const auto index = frame.ip - func->get_chunk().code_begin();
-    *out << "[line " << std::setfill('0') << std::setw(4)
-         << func->get_chunk().line_at(index) << "] in " << func->to_string()
-         << "\n";
+    const auto& chunk = func->get_chunk();
+    if (chunk.has_lines()) {
+      const auto index = frame.ip - chunk.code_begin();
+      *out << "[line " << std::setfill('0') << std::setw(4)
+           << chunk.line_at(index) << "] ";
+    }
+    *out << "in " << func->to_string() << "\n";
   }
 }
 
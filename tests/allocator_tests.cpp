@@ -0,0 +1,176 @@
+#include <doctest/doctest.h>
+
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include "allocator.h"
+
+TEST_CASE("allocator: size classes") {
+  lox::Allocator allocator;
+  REQUIRE_EQ(allocator.page_count(), 0);
+
+  auto small = allocator.allocate(24);
+  auto other_small = allocator.allocate(32);
+  REQUIRE_EQ(allocator.page_count(), 1);
+  const auto distance =
+      static_cast<std::byte*>(other_small) - static_cast<std::byte*>(small);
+  REQUIRE_EQ(static_cast<size_t>(distance), lox::Allocator::cell_size_of(24));
+
+  auto medium = allocator.allocate(100);
+  REQUIRE_EQ(allocator.page_count(), 2);
+  REQUIRE_EQ(reinterpret_cast<uintptr_t>(medium) % lox::Allocator::granularity,
+             0);
+
+  allocator.deallocate(small, 24);
+  allocator.deallocate(other_small, 32);
+  allocator.deallocate(medium, 100);
+}
+
+TEST_CASE("allocator: reuse free cells") {
+  lox::Allocator allocator;
+  constexpr size_t size = 48;
+  auto first = allocator.allocate(size);
+  auto second = allocator.allocate(size);
+  allocator.deallocate(first, size);
+  REQUIRE_EQ(allocator.allocate(size), first);
+  allocator.deallocate(second, size);
+  REQUIRE_EQ(allocator.allocate(size), second);
+}
+
+TEST_CASE("allocator: fresh pages") {
+  lox::Allocator allocator;
+  constexpr size_t size = 64;
+  constexpr auto count = 2 * lox::Allocator::page_size / size;
+  std::set<void*> cells;
+  for (size_t i = 0; i < count; ++i) {
+    cells.insert(allocator.allocate(size));
+  }
+  REQUIRE_EQ(cells.size(), count);
+  REQUIRE_EQ(allocator.page_count(), 3);
+}
+
+TEST_CASE("allocator: large objects") {
+  lox::Allocator allocator;
+  constexpr auto size = lox::Allocator::max_small_size + 1;
+  auto large = allocator.allocate(size);
+  REQUIRE(large);
+  REQUIRE_EQ(allocator.page_count(), 0);
+  allocator.deallocate(large, size);
+}
+
+static int finalized = 0;
+
+static void count_finalized(void*) noexcept { ++finalized; }
+
+TEST_CASE("allocator: lazy sweep") {
+  finalized = 0;
+  lox::Allocator allocator{count_finalized};
+  constexpr size_t size = 32;
+  constexpr int count = 10;
+  void* cells[count];
+  for (auto& cell : cells) {
+    cell = allocator.allocate(size);
+  }
+  for (int i = 0; i < count; i += 2) {
+    REQUIRE(lox::Allocator::mark(cells[i]));
+  }
+  REQUIRE(!lox::Allocator::mark(cells[0]));
+  REQUIRE(!lox::Allocator::is_marked(cells[1]));
+
+  allocator.begin_sweep();
+  REQUIRE_EQ(finalized, 0);
+  auto reused = allocator.allocate(size);
+  REQUIRE_EQ(finalized, count / 2);
+  REQUIRE_EQ(reused, cells[1]);
+  for (int i = 0; i < count; i += 2) {
+    REQUIRE(!lox::Allocator::is_marked(cells[i]));
+  }
+
+  allocator.begin_sweep();
+  allocator.finish_sweep();
+  REQUIRE_EQ(finalized, count + 1);
+  REQUIRE_EQ(allocator.page_count(), 1);
+}
+
+TEST_CASE("allocator: finalize on destruction") {
+  finalized = 0;
+  {
+    lox::Allocator allocator{count_finalized};
+    allocator.allocate(16);
+    allocator.allocate(100);
+    allocator.allocate(lox::Allocator::max_small_size * 2);
+  }
+  REQUIRE_EQ(finalized, 3);
+}
+
+TEST_CASE("allocator: nursery") {
+  finalized = 0;
+  lox::Allocator allocator{count_finalized};
+  auto first = allocator.allocate_young(24);
+  auto second = allocator.allocate_young(100);
+  REQUIRE(lox::Allocator::is_young(first));
+  REQUIRE_EQ(static_cast<std::byte*>(second) - static_cast<std::byte*>(first),
+             static_cast<std::ptrdiff_t>(lox::Allocator::cell_size_of(24)));
+  REQUIRE_EQ(allocator.nursery_page_count(), 1);
+  REQUIRE_EQ(allocator.page_count(), 0);
+
+  auto old = allocator.allocate(100);
+  REQUIRE(!lox::Allocator::is_young(old));
+  REQUIRE(!lox::Allocator::forwarded(first));
+  lox::Allocator::forward(first, old);
+  REQUIRE_EQ(lox::Allocator::forwarded(first), old);
+
+  allocator.reset_nursery(1);
+  REQUIRE_EQ(finalized, 1);
+  REQUIRE_EQ(allocator.allocate_young(24), first);
+  REQUIRE(!lox::Allocator::forwarded(first));
+}
+
+TEST_CASE("allocator: release surplus nursery pages") {
+  lox::Allocator allocator;
+  while (allocator.nursery_page_count() < 3) {
+    allocator.allocate_young(lox::Allocator::max_small_size);
+  }
+  REQUIRE_EQ(allocator.nursery_page_count(), 3);
+  allocator.reset_nursery(2);
+  REQUIRE_EQ(allocator.nursery_page_count(), 2);
+}
+
+TEST_CASE("allocator: evacuate sparse pages") {
+  finalized = 0;
+  lox::Allocator allocator{count_finalized};
+  constexpr size_t size = 64;
+  std::vector<void*> first_page;
+  std::vector<void*> second_page;
+  // The third page holds a single dead cell.
+  while (allocator.page_count() < 3) {
+    const auto cell = allocator.allocate(size);
+    if (allocator.page_count() == 1) {
+      first_page.push_back(cell);
+    } else if (allocator.page_count() == 2) {
+      second_page.push_back(cell);
+    }
+  }
+  lox::Allocator::mark(first_page[0]);
+  for (auto cell : second_page) {
+    lox::Allocator::mark(cell);
+  }
+
+  allocator.begin_sweep();
+  allocator.begin_evacuation();
+  REQUIRE_EQ(allocator.page_count(), 1);
+  REQUIRE_EQ(finalized, static_cast<int>(first_page.size()));
+  allocator.finish_sweep();
+
+  std::vector<void*> evacuees;
+  allocator.for_each_evacuee([&](void* cell) { evacuees.push_back(cell); });
+  REQUIRE_EQ(evacuees.size(), 1);
+  REQUIRE_EQ(evacuees[0], first_page[0]);
+  const auto copy = allocator.allocate(size);
+  lox::Allocator::forward(first_page[0], copy);
+  REQUIRE_EQ(lox::Allocator::forwarded(first_page[0]), copy);
+
+  allocator.release_evacuated();
+  REQUIRE_EQ(allocator.page_count(), 2);
+}
@@ -12,11 +12,10 @@ TEST_CASE("chunk") {
   const auto constant = chunk.add_constant(1.2);
   chunk.add<lox::instruction::Constant>(constant, 1);
 
-  lox::instruction::Closure::Upvalue_vector upvalues{{100, 0}, {200, 1}};
   lox::Function func;
-  func.upvalue_count = upvalues.size();
+  func.captures = {{100, false}, {200, true}};
   const auto func_index = chunk.add_constant(&func);
-  chunk.add<lox::instruction::Closure>(func_index, upvalues, 2);
+  chunk.add<lox::instruction::Closure>(func_index, 2);
 
   const auto jump = chunk.add<lox::instruction::Jump>(0, 3);
   chunk.patch_jump(jump, 5);
@@ -27,8 +26,35 @@ TEST_CASE("chunk") {
 0000    1 OP_Constant 1.200000
 0002    2 OP_Closure <script>
         upvalues:  upvalue 100, local 200,
-0008    3 OP_Jump 5 -> 16
-0011    4 OP_Return
+0004    3 OP_Jump 5 -> 12
+0007    4 OP_Return
 )";
   REQUIRE_EQ(chunk.to_string("test"), expected);
 }
+
+TEST_CASE("chunk: line runs") {
+  lox::Chunk chunk;
+  const auto constant = chunk.add_constant(1.0);
+  chunk.add<lox::instruction::Constant>(constant, 1);
+  chunk.add<lox::instruction::Constant>(constant, 1);
+  chunk.add<lox::instruction::Pop>(3);
+  chunk.add<lox::instruction::Return>(7);
+
+  REQUIRE(chunk.has_lines());
+  REQUIRE_EQ(chunk.get_lines().size(), 3);
+  const size_t expected[] = {1, 1, 1, 1, 3, 7};
+  for (size_t pos = 0; pos < chunk.code_size(); ++pos) {
+    REQUIRE_EQ(chunk.line_at(pos), expected[pos]);
+  }
+}
+
+TEST_CASE("chunk: strip lines") {
+  lox::Chunk chunk;
+  chunk.strip_lines();
+  chunk.add<lox::instruction::Nil>(1);
+  chunk.add<lox::instruction::Return>(2);
+
+  REQUIRE(!chunk.has_lines());
+  REQUIRE(chunk.get_lines().empty());
+  REQUIRE_EQ(chunk.line_at(1), 0);
+}
@@ -175,3 +175,136 @@ print 0 and "ok";
 )";
   CHECK_EQ(compile(source, "and truth"), expected);
 }
+
+TEST_CASE("compiler: lazy function") {
+  const std::string source{R"(
+fun add(a, b) { return a + b; }
+print add(1, 2);
+)"};
+  const std::string expected = R"(== lazy function ==
+0000    2 OP_Closure <func: add>
+        upvalues: 
+0002    | OP_Define_global add
+0004    3 OP_Get_global add
+0006    | OP_Constant 1.000000
+0008    | OP_Constant 2.000000
+0010    | OP_Call 2
+0012    | OP_Print
+0013    4 OP_Nil
+0014    | OP_Return
+)";
+  lox::Compile_options options;
+  options.lazy_functions = true;
+  CHECK_EQ(compile(source, "lazy function", options), expected);
+}
+
+TEST_CASE("compiler: lazy function errors") {
+  const std::string source{R"(
+fun broken() { print; }
+print "before";
+broken();
+)"};
+  lox::Options options;
+  options.compile.lazy_functions = true;
+  CHECK_EQ(run(source, options),
+           "before\n[line 2] Error at ';': Expect expression.\n");
+
+  options.compile.verify_lazy_functions = true;
+  CHECK_EQ(run(source, options), "[line 2] Error at ';': Expect expression.\n");
+}
+
+TEST_CASE("compiler: lazy function with closures") {
+  const std::string source{R"(
+fun make_counter() {
+  var count = 0;
+  fun counter() {
+    count = count + 1;
+    return count;
+  }
+  return counter;
+}
+fun unused() { { { } } }
+var counter = make_counter();
+counter();
+print counter();
+)"};
+  lox::Options options;
+  options.compile.lazy_functions = true;
+  CHECK_EQ(run(source, options), "2.000000\n");
+}
+
+TEST_CASE("compiler: strip debug info") {
+  const std::string source{R"(
+fun fail() {
+  return -nil;
+}
+fail();
+)"};
+  REQUIRE_EQ(run(source),
+             "Operand must be a number.\n[line 0003] in <func: fail>\n"
+             "[line 0005] in <script>\n");
+
+  lox::Options options;
+  options.compile.strip_debug_info = true;
+  REQUIRE_EQ(run(source, options),
+             "Operand must be a number.\nin <func: fail>\nin <script>\n");
+}
+
+TEST_CASE("compiler: resolve names through nested functions") {
+  const std::string source{R"(
+var a = "global a";
+fun outer() {
+  var a = "outer a";
+  var b = "outer b";
+  fun middle() {
+    var b = "middle b";
+    fun inner() {
+      print a;
+      print b;
+      {
+        var a = "block a";
+        print a;
+      }
+      print a;
+    }
+    inner();
+  }
+  middle();
+}
+outer();
+print a;
+)"};
+  REQUIRE_EQ(run(source),
+             "outer a\nmiddle b\nblock a\nouter a\nglobal a\n");
+}
+
+TEST_CASE("compiler: copy captured locals that are never assigned") {
+  const std::string source{R"({
+  var fixed = 1;
+  var changed = 2;
+  fun f() { return fixed + changed; }
+  changed = 3;
+}
+)"};
+  const std::string expected = R"(== final captures ==
+0000    2 OP_Constant 1.000000
+0002    3 OP_Constant 2.000000
+0004    4 OP_Closure <func: f>
+    0000    4 OP_Get_upvalue 0
+    0002    | OP_Get_upvalue 1
+    0004    | OP_Add
+    0005    | OP_Return
+    0006    | OP_Nil
+    0007    | OP_Return
+        upvalues:  copy 1, local 2,
+0006    5 OP_Constant 3.000000
+0008    | OP_Set_local 2
+0010    | OP_Pop
+0011    6 OP_Pop
+0012    | OP_Close_upvalue
+0013    | OP_Pop
+0014    7 OP_Nil
+0015    | OP_Return
+)";
+  CHECK_EQ(compile(source, "final captures"), expected);
+}
@@ -1,9 +1,17 @@
 #include <doctest/doctest.h>
 
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "gc.h"
 #include "hash_table.h"
+#include "heap.h"
 #include "list.h"
 #include "object.h"
 #include "stack.h"
@@ -15,10 +23,79 @@ struct Heap_mockup {
   using Upvalue_list = lox::List<lox::Upvalue, false>;
 
   const Upvalue_list& get_open_upvalues() const noexcept { return upvalues; }
+  Upvalue_list& get_open_upvalues() noexcept { return upvalues; }
 
-  void sweep() noexcept {}
+  bool mark(lox::Object* object) noexcept {
+    return marked.insert(object).second;
+  }
+  bool mark_atomic(lox::Object* object) noexcept {
+    const std::lock_guard<std::recursive_mutex> guard{mutex};
+    return mark(object);
+  }
+  bool is_marked(const lox::Object* object) const noexcept {
+    return marked.count(object) > 0;
+  }
+
+  size_t sweep(size_t) noexcept { return 0; }
+  void finish_sweep() noexcept {}
+
+  void set_marking(bool) noexcept {}
+  void set_concurrent_marking(bool value) noexcept { concurrent = value; }
+  std::unique_lock<std::recursive_mutex> guard_marker() noexcept {
+    return concurrent ? std::unique_lock<std::recursive_mutex>{mutex}
+                      : std::unique_lock<std::recursive_mutex>{};
+  }
+  template <typename Visitor>
+  void drain_shaded(Visitor&& visitor) noexcept {
+    for (auto object : shaded) {
+      visitor(object);
+    }
+    shaded.clear();
+  }
+
+  // Promotion keeps objects in place, it only makes them old.
+  bool is_young(const lox::Object* object) const noexcept {
+    return young.count(object) > 0;
+  }
+  static lox::Object* forwarded(lox::Object*) noexcept { return nullptr; }
+  lox::Object* promote(lox::Object* object) noexcept {
+    young.erase(object);
+    return object;
+  }
+  void sweep_young() noexcept { dropped = std::move(young); }
+
+  size_t interned_string_count() const noexcept { return 0; }
+
+  // Nothing is sparse, so compaction moves nothing.
+  size_t evacuate_sparse_pages() noexcept { return 0; }
+  void release_evacuated_pages() noexcept {}
+  template <typename Visitor>
+  void for_each_old_object(Visitor&&) noexcept {}
+  template <typename Visitor>
+  void update_interned_strings(Visitor&&) noexcept {}
+
+  template <typename Visitor>
+  void for_each_remembered_object(Visitor&& visitor) noexcept {
+    for (auto holder : remembered_objects) {
+      visitor(holder);
+    }
+  }
+  template <typename Visitor>
+  void for_each_remembered_table(Visitor&& visitor) noexcept {
+    for (auto table : remembered_tables) {
+      visitor(*table);
+    }
+  }
 
   Upvalue_list upvalues;
+  std::unordered_set<const lox::Object*> marked;
+  std::unordered_set<const lox::Object*> young;
+  std::unordered_set<const lox::Object*> dropped;
+  std::vector<lox::Object*> remembered_objects;
+  std::vector<lox::Hash_table*> remembered_tables;
+  std::vector<lox::Object*> shaded;
+  std::recursive_mutex mutex;
+  bool concurrent = false;
 };
 
 struct Call_frame {
@@ -30,8 +107,8 @@ using Value_stack = lox::Stack<lox::Value, max_size>;
 
 struct Compiler {
   template <typename Visitor>
-  void for_each_func(Visitor&& visitor) const noexcept {
-    for (auto func : functions) {
+  void for_each_func(Visitor&& visitor) noexcept {
+    for (auto& func : functions) {
       visitor(func);
     }
   }
@@ -40,66 +117,304 @@ struct Compiler {
 };
 
 TEST_CASE("gc") {
+  // Strings keep their characters inline, so only a heap makes them.
+  lox::Heap string_heap;
   Heap_mockup heap;
   lox::Hash_table globals;
   Value_stack stack;
   Call_frame_stack call_frames;
   Compiler compiler;
 
-  lox::String string{"string"};
+  auto& string = *string_heap.make_string("string");
   stack.push(&string);
 
-  lox::String key{"key"};
-  lox::String value{"value"};
+  auto& key = *string_heap.make_string("key");
+  auto& value = *string_heap.make_string("value");
   globals.insert(&key, &value);
 
   lox::Function func;
-  lox::String func_name{"func"};
+  auto& func_name = *string_heap.make_string("func");
   func.name = &func_name;
-  func.upvalue_count = 1;
+  func.captures.resize(1);
 
   lox::Upvalue upvalue{nullptr};
-  lox::String closed{"closed"};
+  auto& closed = *string_heap.make_string("closed");
   upvalue.closed = &closed;
 
-  lox::Closure closure{&func};
+  auto& closure = *string_heap.make_closure(&func);
   closure.get_upvalues()[0] = &upvalue;
   call_frames.push(&closure);
 
   lox::Upvalue open_upvalue{nullptr};
-  lox::String open_closed{"open_closed"};
+  auto& open_closed = *string_heap.make_string("open_closed");
   open_upvalue.closed = &open_closed;
   heap.upvalues.insert(&open_upvalue);
 
   lox::Function compile_func;
-  lox::String compile_func_name{"compile_func"};
+  auto& compile_func_name = *string_heap.make_string("compile_func");
   func.name = &compile_func_name;
 
   compiler.functions.push_back(&compile_func);
 
-  REQUIRE(!string.is_marked);
-  REQUIRE(!key.is_marked);
-  REQUIRE(!value.is_marked);
-  REQUIRE(!func.is_marked);
-  REQUIRE(!upvalue.is_marked);
-  REQUIRE(!closed.is_marked);
-  REQUIRE(!closure.is_marked);
-  REQUIRE(!open_upvalue.is_marked);
-  REQUIRE(!open_closed.is_marked);
-  REQUIRE(!compile_func.is_marked);
+  REQUIRE(!heap.is_marked(&string));
+  REQUIRE(!heap.is_marked(&key));
+  REQUIRE(!heap.is_marked(&value));
+  REQUIRE(!heap.is_marked(&func));
+  REQUIRE(!heap.is_marked(&upvalue));
+  REQUIRE(!heap.is_marked(&closed));
+  REQUIRE(!heap.is_marked(&closure));
+  REQUIRE(!heap.is_marked(&open_upvalue));
+  REQUIRE(!heap.is_marked(&open_closed));
+  REQUIRE(!heap.is_marked(&compile_func));
 
   lox::GC<Heap_mockup, lox::Hash_table, Value_stack, Call_frame_stack, Compiler>
       gc{heap, globals, stack, call_frames, compiler};
   gc.collect_garbage();
 
-  REQUIRE(string.is_marked);
-  REQUIRE(key.is_marked);
-  REQUIRE(value.is_marked);
-  REQUIRE(func.is_marked);
-  REQUIRE(upvalue.is_marked);
-  REQUIRE(closed.is_marked);
-  REQUIRE(closure.is_marked);
-  REQUIRE(open_upvalue.is_marked);
-  REQUIRE(open_closed.is_marked);
-  REQUIRE(compile_func.is_marked);
+  REQUIRE(heap.is_marked(&string));
+  REQUIRE(heap.is_marked(&key));
+  REQUIRE(heap.is_marked(&value));
+  REQUIRE(heap.is_marked(&func));
+  REQUIRE(heap.is_marked(&upvalue));
+  REQUIRE(heap.is_marked(&closed));
+  REQUIRE(heap.is_marked(&closure));
+  REQUIRE(heap.is_marked(&open_upvalue));
+  REQUIRE(heap.is_marked(&open_closed));
+  REQUIRE(heap.is_marked(&compile_func));
+
+  const auto& stats = gc.get_stats();
+  REQUIRE_EQ(stats.full_collections, 1);
+  REQUIRE_EQ(stats.young_collections, 1);
+  const auto& live = stats.live_objects;
+  REQUIRE_EQ(live[lox::Object::id_of<lox::String>], 6);
+  REQUIRE_EQ(live[lox::Object::id_of<lox::Function>], 2);
+  REQUIRE_EQ(live[lox::Object::id_of<lox::Native_func>], 0);
+  REQUIRE_EQ(live[lox::Object::id_of<lox::Upvalue>], 2);
+  REQUIRE_EQ(live[lox::Object::id_of<lox::Closure>], 1);
+}
+
+TEST_CASE("gc: collect young") {
+  // Strings keep their characters inline, so only a heap makes them.
+  lox::Heap string_heap;
+  Heap_mockup heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  Compiler compiler;
+
+  auto& string = *string_heap.make_string("string");
+  stack.push(&string);
+
+  auto& key = *string_heap.make_string("key");
+  auto& value = *string_heap.make_string("value");
+  globals.insert(&key, &value);
+  heap.remembered_tables.push_back(&globals);
+
+  lox::Function func;
+  auto& func_name = *string_heap.make_string("func");
+  func.name = &func_name;
+  func.captures.resize(1);
+  auto& closure = *string_heap.make_closure(&func);
+  call_frames.push(&closure);
+
+  lox::Upvalue upvalue{nullptr};
+  auto& closed = *string_heap.make_string("closed");
+  upvalue.closed = &closed;
+  closure.get_upvalues()[0] = &upvalue;
+  heap.remembered_objects.push_back(&upvalue);
+
+  auto& garbage = *string_heap.make_string("garbage");
+
+  for (lox::Object* object : std::initializer_list<lox::Object*>{
+           &string, &key, &value, &closure, &func, &func_name, &closed,
+           &garbage}) {
+    heap.young.insert(object);
+  }
+
+  lox::GC<Heap_mockup, lox::Hash_table, Value_stack, Call_frame_stack, Compiler>
+      gc{heap, globals, stack, call_frames, compiler};
+  gc.collect_young();
+
+  REQUIRE_EQ(heap.dropped.size(), 1);
+  REQUIRE(heap.dropped.count(&garbage));
+  REQUIRE(heap.marked.empty());
+}
+
+TEST_CASE("gc: incremental marking") {
+  // Strings keep their characters inline, so only a heap makes them.
+  lox::Heap string_heap;
+  Heap_mockup heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  Compiler compiler;
+
+  lox::Function func;
+  auto& constant = *string_heap.make_string("constant");
+  func.get_chunk().add_constant(&constant);
+  func.captures.resize(1);
+  auto& closure = *string_heap.make_closure(&func);
+  lox::Upvalue upvalue{nullptr};
+  closure.get_upvalues()[0] = &upvalue;
+  stack.push(&closure);
+
+  auto& closed = *string_heap.make_string("closed");
+  upvalue.closed = &closed;
+
+  lox::GC<Heap_mockup, lox::Hash_table, Value_stack, Call_frame_stack, Compiler>
+      gc{heap, globals, stack, call_frames, compiler};
+  gc.begin_marking();
+  REQUIRE(heap.is_marked(&closure));
+  REQUIRE(!heap.is_marked(&func));
+
+  // The overwritten value is shaded by the write barrier.
+  auto& stored = *string_heap.make_string("stored");
+  heap.shaded.push_back(upvalue.closed.as_object());
+  upvalue.closed = &stored;
+
+  while (!gc.mark_step(lox::Pause_recorder::Duration::zero())) {
+  }
+  REQUIRE(heap.is_marked(&func));
+  REQUIRE(heap.is_marked(&constant));
+  REQUIRE(heap.is_marked(&upvalue));
+  REQUIRE(heap.is_marked(&closed));
+  REQUIRE(heap.is_marked(&stored));
+
+  auto& dropped = *string_heap.make_string("dropped");
+  gc.finish_marking();
+  REQUIRE(!heap.is_marked(&dropped));
+}
+
+TEST_CASE("gc: concurrent marking") {
+  // Strings keep their characters inline, so only a heap makes them.
+  lox::Heap string_heap;
+  Heap_mockup heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  Compiler compiler;
+
+  std::vector<lox::String*> strings;
+  lox::Function func;
+  for (int i = 0; i < 1000; ++i) {
+    strings.push_back(string_heap.make_string(std::to_string(i)));
+    func.get_chunk().add_constant(strings.back());
+  }
+  auto& closure = *string_heap.make_closure(&func);
+  stack.push(&closure);
+
+  lox::Gc_options options;
+  options.concurrent_marking = true;
+  lox::GC<Heap_mockup, lox::Hash_table, Value_stack, Call_frame_stack, Compiler>
+      gc{heap, globals, stack, call_frames, compiler, options};
+  gc.begin_marking();
+  REQUIRE(heap.concurrent);
+  while (!gc.mark_step(lox::Pause_recorder::Duration::zero())) {
+    std::this_thread::yield();
+  }
+  gc.finish_marking();
+  REQUIRE(!heap.concurrent);
+  REQUIRE(heap.is_marked(&func));
+  for (const auto string : strings) {
+    REQUIRE(heap.is_marked(string));
+  }
+}
+
+TEST_CASE("gc: pause recorder") {
+  lox::Pause_recorder pauses;
+  REQUIRE_EQ(pauses.percentile(0.99), lox::Pause_recorder::Duration::zero());
+  for (int i = 100; i > 0; --i) {
+    pauses.record(std::chrono::milliseconds{i});
+  }
+  REQUIRE_EQ(pauses.count(), 100);
+  REQUIRE_EQ(pauses.max(), std::chrono::milliseconds{100});
+  REQUIRE_EQ(pauses.percentile(0.99), std::chrono::milliseconds{99});
+  REQUIRE_EQ(pauses.percentile(0.5), std::chrono::milliseconds{51});
+
+  const auto histogram = pauses.histogram();
+  REQUIRE_EQ(histogram[9], 0);
+  REQUIRE_EQ(histogram[10], 1);
+  REQUIRE_EQ(histogram[11], 1);
+  REQUIRE_EQ(histogram[12], 2);
+  REQUIRE_EQ(histogram[13], 4);
+  REQUIRE_EQ(histogram[14], 8);
+  REQUIRE_EQ(histogram[15], 84);
+}
+
+TEST_CASE("gc: parallel marking") {
+  // Strings keep their characters inline, so only a heap makes them.
+  lox::Heap string_heap;
+  Heap_mockup heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  Compiler compiler;
+
+  constexpr int fanout = 100;
+  std::vector<std::unique_ptr<lox::Function>> funcs;
+  std::vector<lox::String*> strings;
+  lox::Function root;
+  for (int i = 0; i < fanout; ++i) {
+    funcs.push_back(std::make_unique<lox::Function>());
+    root.get_chunk().add_constant(funcs.back().get());
+    for (int j = 0; j < fanout; ++j) {
+      strings.push_back(
+          string_heap.make_string(std::to_string(i * fanout + j)));
+      funcs.back()->get_chunk().add_constant(strings.back());
+    }
+  }
+  auto& closure = *string_heap.make_closure(&root);
+  stack.push(&closure);
+
+  lox::Gc_options options;
+  options.marker_threads = 4;
+  lox::GC<Heap_mockup, lox::Hash_table, Value_stack, Call_frame_stack, Compiler>
+      gc{heap, globals, stack, call_frames, compiler, options};
+  gc.collect_garbage();
+  REQUIRE_EQ(heap.marked.size(), 2 + funcs.size() + strings.size());
+}
+
+TEST_CASE("gc: heap size heuristics") {
+  Heap_mockup heap;
+  lox::Hash_table globals;
+  Value_stack stack;
+  Call_frame_stack call_frames;
+  Compiler compiler;
+  using Gc =
+      lox::GC<Heap_mockup, lox::Hash_table, Value_stack, Call_frame_stack,
+              Compiler>;
+
+  SUBCASE("grow factor and min heap") {
+    lox::Gc_options options;
+    options.initial_heap = 1000;
+    options.heap_grow_factor = 1.5;
+    options.min_heap = 2000;
+    Gc gc{heap, globals, stack, call_frames, compiler, options};
+    const auto tracker = lox::Memory_tracker::current();
+    tracker->allocate(1000);
+    REQUIRE(!gc.is_collection_requested());
+    tracker->allocate(1);
+    REQUIRE(gc.is_collection_requested());
+
+    gc.collect_garbage();
+    tracker->allocate(999);
+    REQUIRE(!gc.is_collection_requested());
+    tracker->allocate(1);
+    REQUIRE(gc.is_collection_requested());
+  }
+
+  SUBCASE("max heap") {
+    lox::Gc_options options;
+    options.initial_heap = 100000;
+    options.heap_grow_factor = 4;
+    options.max_heap = 300000;
+    Gc gc{heap, globals, stack, call_frames, compiler, options};
+    const auto tracker = lox::Memory_tracker::current();
+    tracker->allocate(100001);
+    gc.collect_garbage();
+    tracker->allocate(199999);
+    REQUIRE(!gc.is_collection_requested());
+    tracker->allocate(1);
+    REQUIRE(gc.is_collection_requested());
+  }
 }
@@ -1,54 +1,152 @@
 #include <doctest/doctest.h>
 
-#include <memory>
 #include <vector>
 
 #include "hash_table.h"
+#include "heap.h"
 #include "object.h"
 #include "value.h"
 
 TEST_CASE("hash table: insert") {
+  lox::Heap heap;
   lox::Hash_table table;
-  lox::String string{"string"};
-  table.insert(&string, 1.0);
-  REQUIRE(table.contains(&string));
-  REQUIRE(table.get_if(&string) != nullptr);
-  REQUIRE_EQ(table.get_if(&string)->as_double(), 1);
-  table.set(&string, 2.0);
-  REQUIRE_EQ(table.get_if(&string)->as_double(), 2);
+  const auto string = heap.make_string("string");
+  table.insert(string, 1.0);
+  REQUIRE(table.contains(string));
+  REQUIRE(table.get_if(string) != nullptr);
+  REQUIRE_EQ(table.get_if(string)->as_double(), 1);
+  table.set(string, 2.0);
+  REQUIRE_EQ(table.get_if(string)->as_double(), 2);
 }
 
 TEST_CASE("hash table: insert multiple entries") {
+  lox::Heap heap;
   lox::Hash_table table;
-  std::vector<std::unique_ptr<lox::String>> strings;
+  std::vector<lox::String*> strings;
   for (auto i = 0; i < 100; ++i) {
-    strings.emplace_back(
-        std::make_unique<lox::String>("string " + std::to_string(i)));
+    strings.emplace_back(heap.make_string("string " + std::to_string(i)));
   }
   for (std::size_t i = 0; i < strings.size(); ++i) {
-    table.insert(strings[i].get(), static_cast<double>(i));
+    table.insert(strings[i], static_cast<double>(i));
   }
   for (std::size_t i = 0; i < strings.size(); ++i) {
-    REQUIRE(table.get_if(strings[i].get()) != nullptr);
-    REQUIRE_EQ(table.get_if(strings[i].get())->as_double(), i);
+    REQUIRE(table.get_if(strings[i]) != nullptr);
+    REQUIRE_EQ(table.get_if(strings[i])->as_double(), i);
   }
 }
 
 TEST_CASE("hash table: erase") {
+  lox::Heap heap;
   lox::Hash_table table;
-  std::vector<std::unique_ptr<lox::String>> strings;
+  std::vector<lox::String*> strings;
   for (auto i = 0; i < 100; ++i) {
-    strings.emplace_back(
-        std::make_unique<lox::String>("string " + std::to_string(i)));
+    strings.emplace_back(heap.make_string("string " + std::to_string(i)));
   }
   for (std::size_t i = 0; i < strings.size(); ++i) {
-    table.insert(strings[i].get(), static_cast<double>(i));
+    table.insert(strings[i], static_cast<double>(i));
   }
   for (std::size_t i = 0; i < strings.size(); i += 2) {
-    table.erase(strings[i].get());
+    table.erase(strings[i]);
   }
   for (std::size_t i = 1; i < strings.size(); i += 2) {
-    REQUIRE(table.get_if(strings[i].get()) != nullptr);
-    REQUIRE_EQ(table.get_if(strings[i].get())->as_double(), i);
+    REQUIRE(table.get_if(strings[i]) != nullptr);
+    REQUIRE_EQ(table.get_if(strings[i])->as_double(), i);
   }
 }
+
+TEST_CASE("hash table: reuse erased slots") {
+  lox::Heap heap;
+  lox::Hash_table table;
+  std::vector<lox::String*> strings;
+  for (auto i = 0; i < 1000; ++i) {
+    strings.emplace_back(heap.make_string("string " + std::to_string(i)));
+  }
+  // Keeps a window of 100 keys sliding over all of them, many times.
+  for (auto round = 0; round < 10; ++round) {
+    for (std::size_t i = 0; i < strings.size(); ++i) {
+      table.insert(strings[i], static_cast<double>(i));
+      if (i >= 100) {
+        REQUIRE(table.erase(strings[i - 100]));
+      }
+    }
+    for (std::size_t i = strings.size() - 100; i < strings.size(); ++i) {
+      REQUIRE(table.erase(strings[i]));
+    }
+    REQUIRE_EQ(table.size(), 0);
+  }
+  for (std::size_t i = 0; i < strings.size(); i += 3) {
+    table.insert(strings[i], static_cast<double>(i));
+  }
+  table.erase_if([](const lox::String*, lox::Value value) {
+    return static_cast<int>(value.as_double()) % 2 == 0;
+  });
+  for (std::size_t i = 0; i < strings.size(); ++i) {
+    const auto string = strings[i]->get_string();
+    const auto found = table.find_string(string, lox::String::hash_from(string));
+    REQUIRE_EQ(found != nullptr, i % 3 == 0 && i % 2 == 1);
+    REQUIRE_EQ(table.contains(strings[i]), i % 3 == 0 && i % 2 == 1);
+  }
+}
+
+TEST_CASE("hash table: compact") {
+  lox::Heap heap;
+  lox::Hash_table table;
+  std::vector<lox::String*> strings;
+  for (auto i = 0; i < 1000; ++i) {
+    strings.emplace_back(heap.make_string("string " + std::to_string(i)));
+    table.insert(strings.back(), static_cast<double>(i));
+  }
+  const auto capacity = table.get_capacity();
+  REQUIRE(!table.compact());
+  REQUIRE_GE(table.probe_lengths().mean, 1);
+
+  // Most entries gone: the table shrinks and keeps the rest.
+  table.erase_if([](const lox::String*, lox::Value value) {
+    return value.as_double() >= 10;
+  });
+  REQUIRE(table.compact());
+  REQUIRE_LT(table.get_capacity(), capacity);
+  REQUIRE_EQ(table.deleted_slots(), 0);
+  REQUIRE_EQ(table.size(), 10);
+  for (std::size_t i = 0; i < 10; ++i) {
+    REQUIRE_EQ(table.get_if(strings[i])->as_double(), i);
+  }
+  REQUIRE_EQ(table.probe_lengths().max, 1);
+
+  table.erase_if([](const lox::String*, lox::Value) { return true; });
+  REQUIRE(table.compact());
+  REQUIRE_EQ(table.get_capacity(), 0);
+  REQUIRE(!table.contains(strings[0]));
+  table.insert(strings[0], 1.0);
+  REQUIRE(table.contains(strings[0]));
+}
+
+TEST_CASE("hash table: stats") {
+  lox::Heap heap;
+  lox::Hash_table table;
+  REQUIRE_EQ(table.get_stats().capacity, 0);
+  std::vector<lox::String*> strings;
+  for (auto i = 0; i < 100; ++i) {
+    strings.emplace_back(heap.make_string("string " + std::to_string(i)));
+    table.insert(strings.back(), static_cast<double>(i));
+  }
+  auto stats = table.get_stats();
+  REQUIRE_EQ(stats.capacity, table.get_capacity());
+  REQUIRE_GT(stats.growths, 1);
+  REQUIRE_EQ(stats.shrinks, 0);
+  REQUIRE_EQ(stats.load, 100.0 / static_cast<double>(stats.capacity));
+  REQUIRE_EQ(stats.deleted_ratio, 0);
+  REQUIRE_GE(stats.mean_probe, 1);
+  REQUIRE_GE(stats.max_probe, 1);
+
+  table.erase_if([](const lox::String*, lox::Value) { return true; });
+  table.compact();
+  stats = table.get_stats();
+  REQUIRE_EQ(stats.shrinks, 1);
+  REQUIRE_EQ(stats.capacity, 0);
+  REQUIRE_EQ(stats.mean_probe, 0);
+
+  size_t visited = 0;
+  stats.for_each([&](const char*, auto) { ++visited; });
+  REQUIRE_EQ(visited, 8);
+}
@@ -0,0 +1,34 @@
+#include <doctest/doctest.h>
+
+#include <set>
+#include <string>
+
+#include "hash.h"
+
+template <typename Hash>
+void check_hash() {
+  const Hash hash;
+  std::string text;
+  std::set<uint32_t> hashes;
+  for (int length = 0; length <= 100; ++length) {
+    // The same characters at another address hash the same.
+    const std::string copy = text;
+    REQUIRE_EQ(hash(text), hash(copy));
+    REQUIRE(hashes.insert(hash(text)).second);
+    text.push_back(static_cast<char>('a' + length % 26));
+  }
+  // Every byte counts, including the last one and non-ASCII ones.
+  REQUIRE_NE(hash("identifier1"), hash("identifier2"));
+  REQUIRE_NE(hash("1identifier"), hash("2identifier"));
+  REQUIRE_NE(hash(std::string(40, 'x') + "a"), hash(std::string(40, 'x') + "b"));
+  REQUIRE_NE(hash("\xe0\xa5\x90"), hash("\xe0\xa5\x91"));
+}
+
+TEST_CASE("hash: fnv-1a") {
+  check_hash<lox::hash::Fnv1a>();
+  REQUIRE_EQ(lox::hash::Fnv1a{}(""), 2166136261u);
+  REQUIRE_EQ(lox::hash::Fnv1a{}("a"), 0xe40c292cu);
+  REQUIRE_EQ(lox::hash::Fnv1a{}("foobar"), 0xbf9cf968u);
+}
+
+TEST_CASE("hash: wyhash") { check_hash<lox::hash::Wyhash>(); }
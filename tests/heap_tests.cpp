@@ -1,6 +1,7 @@
 #include <doctest/doctest.h>
 
 #include <string>
+#include <vector>
 
 #include "heap.h"
 
@@ -9,3 +10,171 @@ TEST_CASE("heap: make string") {
   std::string str{"string"};
   CHECK_EQ(heap.make_string(str), heap.make_string(str));
 }
+
+TEST_CASE("heap: shrink interned strings") {
+  lox::Heap heap;
+  std::vector<lox::Object*> strings;
+  for (int i = 0; i < 1000; ++i) {
+    strings.push_back(heap.make_string(std::to_string(i)));
+  }
+  for (auto& string : strings) {
+    string = heap.promote(string);
+  }
+  heap.sweep_young();
+  const auto& interned = heap.get_interned_strings();
+  const auto capacity = interned.get_capacity();
+  REQUIRE_EQ(heap.interned_string_count(), 1000);
+
+  REQUIRE(lox::Heap::mark(strings.front()));
+  heap.sweep(strings.front()->size());
+  heap.finish_sweep();
+  REQUIRE_EQ(heap.interned_string_count(), 1);
+  REQUIRE_LT(interned.get_capacity(), capacity);
+  REQUIRE_EQ(heap.make_string("0"), strings.front());
+}
+
+TEST_CASE("heap: reuse nursery pages") {
+  lox::Heap heap;
+  constexpr int count = 100;
+  for (int i = 0; i < count; ++i) {
+    heap.make_object<lox::Upvalue>(nullptr);
+  }
+  const auto pages = heap.get_allocator().nursery_page_count();
+  REQUIRE_EQ(pages, 1);
+  REQUIRE_EQ(heap.get_allocator().page_count(), 0);
+
+  heap.sweep_young();
+  for (int i = 0; i < count; ++i) {
+    heap.make_object<lox::Upvalue>(nullptr);
+  }
+  REQUIRE_EQ(heap.get_allocator().nursery_page_count(), pages);
+}
+
+TEST_CASE("heap: reuse swept objects") {
+  lox::Heap heap;
+  constexpr int count = 100;
+  for (int i = 0; i < count; ++i) {
+    heap.promote(heap.make_object<lox::Upvalue>(nullptr));
+  }
+  heap.sweep_young();
+  const auto pages = heap.get_allocator().page_count();
+  REQUIRE_EQ(pages, 1);
+
+  heap.sweep(0);
+  for (int i = 0; i < count; ++i) {
+    heap.promote(heap.make_object<lox::Upvalue>(nullptr));
+  }
+  heap.sweep_young();
+  REQUIRE_EQ(heap.get_allocator().page_count(), pages);
+}
+
+TEST_CASE("heap: promote young objects") {
+  lox::Heap heap;
+  const auto young = heap.make_string("kept");
+  heap.make_string("dropped");
+  REQUIRE(lox::Heap::is_young(young));
+
+  const auto kept = heap.promote(young);
+  REQUIRE(!lox::Heap::is_young(kept));
+  REQUIRE_EQ(lox::Heap::forwarded(young), kept);
+  REQUIRE_EQ(kept->as<lox::String>()->get_string(), "kept");
+
+  heap.sweep_young();
+  REQUIRE_EQ(heap.make_string("kept"), kept);
+  REQUIRE(lox::Heap::is_young(heap.make_string("dropped")));
+}
+
+TEST_CASE("heap: promote closed upvalue") {
+  lox::Heap heap;
+  const auto young = heap.make_object<lox::Upvalue>(nullptr);
+  young->closed = 1.0;
+  young->location = &young->closed;
+
+  const auto upvalue = heap.promote(young)->as<lox::Upvalue>();
+  REQUIRE_EQ(upvalue->location, &upvalue->closed);
+  REQUIRE_EQ(upvalue->location->as_double(), 1.0);
+  heap.sweep_young();
+}
+
+TEST_CASE("heap: sweep unmarked objects") {
+  lox::Heap heap;
+  const auto kept = heap.promote(heap.make_string("kept"))->as<lox::String>();
+  heap.promote(heap.make_string("dropped"));
+  heap.sweep_young();
+  REQUIRE(lox::Heap::mark(kept));
+  REQUIRE(!lox::Heap::mark(kept));
+  REQUIRE(lox::Heap::is_marked(kept));
+
+  REQUIRE_EQ(heap.sweep(kept->size()), lox::String::size_for(7));
+  heap.finish_sweep();
+  REQUIRE(!lox::Heap::is_marked(kept));
+  REQUIRE_EQ(heap.make_string("kept"), kept);
+  REQUIRE_EQ(kept->get_string(), "kept");
+}
+
+TEST_CASE("heap: write barrier while marking") {
+  lox::Heap heap;
+  const auto holder = heap.promote(heap.make_object<lox::Upvalue>(nullptr));
+  const auto overwritten = heap.promote(heap.make_string("overwritten"));
+  heap.sweep_young();
+
+  heap.set_marking(true);
+  heap.write_barrier(holder, overwritten, heap.make_string("young"));
+  heap.write_barrier(holder, lox::Value{}, overwritten);
+  std::vector<lox::Object*> shaded;
+  heap.drain_shaded([&](lox::Object* object) { shaded.push_back(object); });
+  REQUIRE_EQ(shaded.size(), 1);
+  REQUIRE_EQ(shaded[0], overwritten);
+  heap.set_marking(false);
+
+  heap.write_barrier(holder, overwritten, lox::Value{});
+  heap.drain_shaded([&](lox::Object* object) { shaded.push_back(object); });
+  REQUIRE_EQ(shaded.size(), 1);
+}
+
+TEST_CASE("heap: evacuate sparse pages") {
+  lox::Heap heap;
+  std::vector<lox::Object*> strings;
+  // Texts of one length, so that all strings share a size class.
+  constexpr size_t base = 1000000;
+  while (heap.get_allocator().page_count() < 3) {
+    const auto young = heap.make_string(std::to_string(base + strings.size()));
+    strings.push_back(heap.promote(young));
+    heap.sweep_young();
+  }
+  const auto first = strings.front();
+  REQUIRE(lox::Heap::mark(first));
+  REQUIRE(lox::Heap::mark(strings.back()));
+  heap.sweep(first->size() + strings.back()->size());
+  const auto pages = heap.get_allocator().page_count();
+
+  REQUIRE_EQ(heap.evacuate_sparse_pages(), 2);
+  const auto moved = lox::Heap::forwarded(first);
+  REQUIRE(moved);
+  REQUIRE_EQ(moved->as<lox::String>()->get_string(), "1000000");
+  heap.update_interned_strings([](lox::String* string) {
+    const auto copy = lox::Heap::forwarded(string);
+    return copy ? copy->as<lox::String>() : string;
+  });
+  heap.release_evacuated_pages();
+  REQUIRE_LT(heap.get_allocator().page_count(), pages);
+  REQUIRE_EQ(heap.make_string("1000000"), moved);
+}
+
+TEST_CASE("heap: account owned memory") {
+  lox::Heap heap;
+  // Too large for the nursery, so the string starts old.
+  const auto string = heap.make_string(std::string(1000, 'x'));
+  const auto func =
+      heap.promote(heap.make_object<lox::Function>())->as<lox::Function>();
+  heap.sweep_young();
+
+  const auto old_size = func->size();
+  for (int i = 0; i < 100; ++i) {
+    func->get_chunk().add_constant(1.0);
+  }
+  heap.resized(func, old_size);
+  const auto size = string->size() + func->size();
+  REQUIRE_GT(string->size(), 1000);
+  REQUIRE_EQ(heap.sweep(0), size);
+}
@@ -10,6 +10,7 @@
 #include "compiler.h"
 #include "heap.h"
 #include "object.h"
+#include "options.h"
 #include "scanner.h"
 #include "vm.h"
 
@@ -41,19 +42,20 @@ inline std::pair<std::string, std::string> load(const std::string& filename) {
   throw std::runtime_error{"Read " + filename + " failed."};
 }
 
-inline std::string compile(std::string source,
-                           const std::string& message) noexcept {
+inline std::string compile(std::string source, const std::string& message,
+                           const lox::Compile_options& options = {}) noexcept {
   lox::Scanner scanner{std::move(source)};
   lox::Heap heap;
-  lox::Compiler compiler{heap};
+  lox::Compiler compiler{heap, options};
   auto func = compiler.compile(scanner.scan());
   return func->get_chunk().to_string(message);
 }
 
 template <bool Debug = false>
-inline std::string run(std::string source) noexcept {
+inline std::string run(std::string source,
+                       const lox::Options& options = {}) noexcept {
   std::ostringstream oss;
-  lox::VM vm{oss};
+  lox::VM vm{oss, options};
   vm.interpret<Debug>(std::move(source));
   return oss.str();
 }
@@ -0,0 +1,76 @@
+#include <doctest/doctest.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "helper.h"
+#include "image.h"
+
+static const std::string source = R"(
+var greeting = "hello";
+fun make_adder(n) {
+  fun add(x) { return x + n; }
+  return add;
+}
+print greeting + " world";
+print make_adder(1)(2);
+print true;
+print nil;
+)";
+
+static lox::Function* compile_script(lox::Compiler& compiler) {
+  lox::Scanner scanner{source};
+  return compiler.compile(scanner.scan());
+}
+
+TEST_CASE("image: save and load") {
+  lox::Heap heap;
+  lox::Compiler compiler{heap};
+  const auto script = compile_script(compiler);
+  const auto bytes = lox::image::save(*script, 42);
+  REQUIRE(!bytes.empty());
+
+  lox::Heap other_heap;
+  const auto loaded =
+      lox::image::load(bytes.data(), bytes.size(), other_heap, 42);
+  REQUIRE(loaded != nullptr);
+  REQUIRE_EQ(loaded->to_string(true), script->to_string(true));
+  REQUIRE_EQ(loaded->get_chunk().line_at(0), script->get_chunk().line_at(0));
+}
+
+TEST_CASE("image: reject invalid images") {
+  lox::Heap heap;
+  lox::Compiler compiler{heap};
+  const auto bytes = lox::image::save(*compile_script(compiler), 42);
+
+  lox::Heap other_heap;
+  REQUIRE(lox::image::load(bytes.data(), bytes.size(), other_heap, 43) ==
+          nullptr);
+  REQUIRE(lox::image::load(bytes.data(), bytes.size() - 1, other_heap, 42) ==
+          nullptr);
+  auto corrupted = bytes;
+  corrupted[0] = 'X';
+  REQUIRE(lox::image::load(corrupted.data(), corrupted.size(), other_heap,
+                           42) == nullptr);
+}
+
+TEST_CASE("image: compile cache") {
+  char directory[] = "/tmp/lox_cache_XXXXXX";
+  REQUIRE(mkdtemp(directory) != nullptr);
+
+  lox::Options options;
+  options.cache_dir = directory;
+  options.compile.lazy_functions = true;
+  const auto expected = run(source);
+  REQUIRE_EQ(run(source, options), expected);
+
+  const auto path = lox::Compile_cache{directory}.path_of(
+      lox::image::hash_of(source));
+  REQUIRE_EQ(access(path.c_str(), R_OK), 0);
+  REQUIRE_EQ(run(source, options), expected);
+
+  unlink(path.c_str());
+  rmdir(directory);
+}
@@ -55,3 +55,19 @@ TEST_CASE("list: insert after") {
     ++expected;
   }
 }
+
+TEST_CASE("list: pop front") {
+  lox::List<Node, false> list;
+  Node nodes[3] = {{0}, {1}, {2}};
+  for (auto& node : nodes) {
+    list.insert(&node);
+  }
+  REQUIRE_EQ(list.front(), &nodes[2]);
+  REQUIRE_EQ(list.pop_front(), &nodes[2]);
+  REQUIRE_EQ(nodes[2].next, nullptr);
+  REQUIRE_EQ(list.pop_front(), &nodes[1]);
+  REQUIRE_EQ(list.front(), &nodes[0]);
+  REQUIRE_EQ(list.pop_front(), &nodes[0]);
+  REQUIRE(list.empty());
+  REQUIRE_EQ(list.front(), nullptr);
+}
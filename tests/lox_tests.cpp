@@ -5,10 +5,18 @@
 #include "config.h"
 #include "helper.h"
 
+inline lox::Options verified_lazy_options() noexcept {
+  lox::Options options;
+  options.compile.lazy_functions = true;
+  options.compile.verify_lazy_functions = true;
+  return options;
+}
+
 #define LOX_TEST_CASE(filename)                                       \
   TEST_CASE("lox: " filename) {                                       \
     auto [source, expected] = load(EXAMPLES_DIR "/" filename ".lox"); \
     REQUIRE_EQ(run(source), expected);                                \
+    REQUIRE_EQ(run(source, verified_lazy_options()), expected);       \
   }
 
 LOX_TEST_CASE("empty_file")
@@ -40,11 +48,13 @@ LOX_TEST_CASE("closure/assign_to_shadowed_later")
 LOX_TEST_CASE("closure/close_over_function_parameter")
 LOX_TEST_CASE("closure/close_over_later_variable")
 LOX_TEST_CASE("closure/closed_closure_in_function")
+LOX_TEST_CASE("closure/copy_final_local")
 LOX_TEST_CASE("closure/nested_closure")
 LOX_TEST_CASE("closure/open_closure_in_function")
 LOX_TEST_CASE("closure/reference_closure_multiple_times")
 LOX_TEST_CASE("closure/reuse_closure_slot")
 LOX_TEST_CASE("closure/shadow_closure_with_local")
+LOX_TEST_CASE("closure/share_capture_free_closure")
 LOX_TEST_CASE("closure/unused_closure")
 LOX_TEST_CASE("closure/unused_later_closure")
 
@@ -152,6 +162,7 @@ LOX_TEST_CASE("return/at_top_level")
 LOX_TEST_CASE("return/in_function")
 LOX_TEST_CASE("return/return_nil_if_no_value")
 
+LOX_TEST_CASE("string/concatenation")
 LOX_TEST_CASE("string/error_after_multiline")
 LOX_TEST_CASE("string/literals")
 LOX_TEST_CASE("string/multiline")
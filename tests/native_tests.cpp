@@ -15,3 +15,10 @@ TEST_CASE("native") {
                   std::chrono::seconds{1})
                   .count()));
 }
+
+TEST_CASE("native: gc stats") {
+  REQUIRE_EQ(run("print gcStats(\"heap_bytes\") > 0;"), "true\n");
+  REQUIRE_EQ(run("print gcStats(\"full_collections\") == 0;"), "true\n");
+  REQUIRE_EQ(run("print gcStats(\"unknown\");"), "nil\n");
+  REQUIRE_EQ(run("print gcStats();"), "nil\n");
+}
@@ -1,12 +1,74 @@
 #include <doctest/doctest.h>
 
 #include <string>
+#include <type_traits>
 
+#include "heap.h"
 #include "object.h"
 
 TEST_CASE("object") {
+  lox::Heap heap;
   const std::string str = "string";
-  lox::String string{str};
-  REQUIRE_EQ(string.get_hash(), lox::String::hash_from(str));
-  REQUIRE_EQ(string, str);
+  const auto string = heap.make_string(str);
+  REQUIRE_EQ(string->get_hash(), lox::String::hash_from(str));
+  REQUIRE_EQ(string->get_string(), str);
+  REQUIRE_EQ(string->get_string().data()[str.size()], '\0');
+  REQUIRE(string->equals(str, lox::String::hash_from(str)));
+  REQUIRE(!string->equals("strings", lox::String::hash_from("strings")));
+}
+
+TEST_CASE("object: size of owned memory") {
+  lox::Heap heap;
+  const auto short_string = heap.make_string("short");
+  REQUIRE_EQ(short_string->size(), sizeof(lox::String) + 6);
+  const std::string str(1000, 'x');
+  const auto long_string = heap.make_string(str);
+  REQUIRE_EQ(long_string->size(), lox::String::size_for(str.size()));
+
+  lox::Function func;
+  const auto empty = func.size();
+  for (int i = 0; i < 100; ++i) {
+    func.get_chunk().add_constant(1.0);
+  }
+  REQUIRE_GE(func.size(), empty + 100 * sizeof(lox::Value));
+
+  func.captures.resize(8);
+  const auto closure = heap.make_closure(&func);
+  REQUIRE_EQ(closure->size(), sizeof(lox::Closure) + 8 * sizeof(lox::Value));
+  for (size_t i = 0; i < closure->get_upvalue_count(); ++i) {
+    REQUIRE(closure->get_upvalues()[i].is_nil());
+  }
+}
+
+TEST_CASE("object: dispatch over types") {
+  static_assert(!std::is_polymorphic_v<lox::String>);
+  lox::Heap heap;
+  const auto string = heap.make_string("string");
+  const lox::Object& object = *string;
+  REQUIRE_EQ(object.size(), string->size());
+  REQUIRE_EQ(object.to_string(), "string");
+  const auto is_string = object.visit([](const auto& visited) {
+    return std::is_same_v<std::decay_t<decltype(visited)>, lox::String>;
+  });
+  REQUIRE(is_string);
+}
+
+TEST_CASE("object: rope") {
+  lox::Heap heap;
+  lox::Object* text = heap.make_string("0");
+  for (int i = 1; i < 10000; ++i) {
+    const auto piece = heap.make_string(std::to_string(i % 10));
+    text = heap.make_object<lox::Rope>(
+        text, piece, lox::Rope::length_of(text) + lox::Rope::length_of(piece));
+  }
+  const auto rope = text->as<lox::Rope>();
+  REQUIRE_EQ(rope->get_length(), 10000);
+  REQUIRE_EQ(rope->to_string().substr(0, 12), "012345678901");
+
+  const auto flat = heap.make_string(rope->to_string());
+  rope->set_flat(flat);
+  REQUIRE_EQ(rope->left, nullptr);
+  REQUIRE_EQ(rope->right, nullptr);
+  REQUIRE_EQ(rope->to_string(), flat->get_string());
+  REQUIRE_EQ(lox::Rope::length_of(rope), 10000);
 }
@@ -20,7 +20,7 @@ andy formless fo _ _123 _abc ab123
 abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890_
 )"};
   const auto tokens = scanner.scan();
-  const std::vector<lox::Token> expected = {
+  const lox::Token_vector expected = {
       {lox::Token::identifier, "andy", 2},
       {lox::Token::identifier, "formless", 2},
       {lox::Token::identifier, "fo", 2},
@@ -40,7 +40,7 @@ TEST_CASE("scanner: keywords") {
 and class else false for fun if nil or return super this true var while
 )"};
   const auto tokens = scanner.scan();
-  const std::vector<lox::Token> expected = {
+  const lox::Token_vector expected = {
       {lox::Token::k_and, "and", 2},     {lox::Token::k_class, "class", 2},
       {lox::Token::k_else, "else", 2},   {lox::Token::k_false, "false", 2},
       {lox::Token::k_for, "for", 2},     {lox::Token::k_func, "fun", 2},
@@ -61,7 +61,7 @@ TEST_CASE("scanner: numbers") {
 123.
 )"};
   const auto tokens = scanner.scan();
-  const std::vector<lox::Token> expected = {
+  const lox::Token_vector expected = {
       {lox::Token::number, "123", 2}, {lox::Token::number, "123.456", 3},
       {lox::Token::dot, ".", 4},      {lox::Token::number, "456", 4},
       {lox::Token::number, "123", 5}, {lox::Token::dot, ".", 5},
@@ -75,7 +75,7 @@ TEST_CASE("scanner: punctuators") {
 (){};,+-*!===<=>=!=<>/.
 )"};
   const auto tokens = scanner.scan();
-  const std::vector<lox::Token> expected = {
+  const lox::Token_vector expected = {
       {lox::Token::left_paren, "(", 2},
       {lox::Token::right_paren, ")", 2},
       {lox::Token::left_brace, "{", 2},
@@ -105,7 +105,7 @@ TEST_CASE("scanner: strings") {
 "string"
 )"};
   const auto tokens = scanner.scan();
-  const std::vector<lox::Token> expected = {
+  const lox::Token_vector expected = {
       {lox::Token::string, "", 2},
       {lox::Token::string, "string", 3},
       {lox::Token::eof, "", 4},
@@ -123,7 +123,7 @@ space    tabs				newlines
 end
 )"};
   const auto tokens = scanner.scan();
-  const std::vector<lox::Token> expected = {
+  const lox::Token_vector expected = {
       {lox::Token::identifier, "space", 2},
       {lox::Token::identifier, "tabs", 2},
       {lox::Token::identifier, "newlines", 2},
@@ -147,3 +147,14 @@ foo(a | b);
 )"};
   REQUIRE_EQ(run(source), expected);
 }
+
+TEST_CASE("scanner: memory resource") {
+  std::pmr::monotonic_buffer_resource arena;
+  lox::Scanner scanner{"var long_identifier_name = \"long string literal\";"};
+  const auto tokens = scanner.scan(&arena);
+  REQUIRE_EQ(tokens.size(), 6);
+  REQUIRE_EQ(tokens.get_allocator().resource(), &arena);
+  for (const auto& token : tokens) {
+    REQUIRE_EQ(token.lexeme.get_allocator().resource(), &arena);
+  }
+}
@@ -1,5 +1,6 @@
 #include <doctest/doctest.h>
 
+#include "heap.h"
 #include "object.h"
 #include "value.h"
 
@@ -26,14 +27,15 @@ TEST_CASE("value: tagged union") {
   }
 
   SUBCASE("object") {
-    lox::String hello("hello");
-    Value value{&hello};
+    lox::Heap heap;
+    const auto hello = heap.make_string("hello");
+    Value value{hello};
     REQUIRE(value.is_object());
-    REQUIRE_EQ(value.as_object(), &hello);
-    lox::String world("world");
-    value = &world;
+    REQUIRE_EQ(value.as_object(), hello);
+    const auto world = heap.make_string("world");
+    value = world;
     REQUIRE(value.is_object());
-    REQUIRE_EQ(value.as_object(), &world);
+    REQUIRE_EQ(value.as_object(), world);
   }
 
   SUBCASE("assignment") {
@@ -44,10 +46,11 @@ TEST_CASE("value: tagged union") {
     value = 1.0;
     REQUIRE(value.is_double());
     REQUIRE_EQ(value.as_double(), 1);
-    lox::String hello("hello");
-    value = &hello;
+    lox::Heap heap;
+    const auto hello = heap.make_string("hello");
+    value = hello;
     REQUIRE(value.is_object());
-    REQUIRE_EQ(value.as_object(), &hello);
+    REQUIRE_EQ(value.as_object(), hello);
   }
 }
 
@@ -74,14 +77,15 @@ TEST_CASE("value: optimized") {
   }
 
   SUBCASE("object") {
-    lox::String hello("hello");
-    Value value{&hello};
+    lox::Heap heap;
+    const auto hello = heap.make_string("hello");
+    Value value{hello};
     REQUIRE(value.is_object());
-    REQUIRE_EQ(value.as_object(), &hello);
-    lox::String world("world");
-    value = &world;
+    REQUIRE_EQ(value.as_object(), hello);
+    const auto world = heap.make_string("world");
+    value = world;
     REQUIRE(value.is_object());
-    REQUIRE_EQ(value.as_object(), &world);
+    REQUIRE_EQ(value.as_object(), world);
   }
 
   SUBCASE("assignment") {
@@ -92,10 +96,11 @@ TEST_CASE("value: optimized") {
     value = 1.0;
     REQUIRE(value.is_double());
     REQUIRE_EQ(value.as_double(), 1);
-    lox::String hello("hello");
-    value = &hello;
+    lox::Heap heap;
+    const auto hello = heap.make_string("hello");
+    value = hello;
     REQUIRE(value.is_object());
-    REQUIRE_EQ(value.as_object(), &hello);
+    REQUIRE_EQ(value.as_object(), hello);
   }
 }
 
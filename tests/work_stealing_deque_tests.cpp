@@ -0,0 +1,66 @@
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "work_stealing_deque.h"
+
+TEST_CASE("work stealing deque") {
+  lox::Work_stealing_deque<int> deque{2};
+  int items[5] = {0, 1, 2, 3, 4};
+  REQUIRE(deque.empty());
+  REQUIRE_EQ(deque.pop(), nullptr);
+  REQUIRE_EQ(deque.steal(), nullptr);
+
+  for (auto& item : items) {
+    deque.push(&item);
+  }
+  REQUIRE(!deque.empty());
+  REQUIRE_EQ(deque.steal(), &items[0]);
+  REQUIRE_EQ(deque.pop(), &items[4]);
+  REQUIRE_EQ(deque.pop(), &items[3]);
+  REQUIRE_EQ(deque.steal(), &items[1]);
+  REQUIRE_EQ(deque.pop(), &items[2]);
+  REQUIRE(deque.empty());
+  REQUIRE_EQ(deque.pop(), nullptr);
+}
+
+TEST_CASE("work stealing deque: concurrent steals") {
+  constexpr int count = 100000;
+  constexpr int thieves = 3;
+  lox::Work_stealing_deque<int> deque;
+  std::vector<int> items(count);
+  std::vector<std::atomic<int>> taken(count);
+  std::atomic<bool> done{false};
+
+  const auto take = [&](int* item) { ++taken[item - items.data()]; };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thieves; ++i) {
+    threads.emplace_back([&] {
+      while (!done || !deque.empty()) {
+        if (const auto item = deque.steal(); item) {
+          take(item);
+        }
+      }
+    });
+  }
+  for (int i = 0; i < count; ++i) {
+    deque.push(&items[i]);
+    if (i % 3 == 0) {
+      if (const auto item = deque.pop(); item) {
+        take(item);
+      }
+    }
+  }
+  while (const auto item = deque.pop()) {
+    take(item);
+  }
+  done = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& times : taken) {
+    REQUIRE_EQ(times.load(), 1);
+  }
+}